@@ -0,0 +1,1118 @@
+#include <algorithm>
+
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+
+#include "ata-bus.hpp"
+
+#include "config.h"
+
+#include "ata.pio.h"
+
+using ata::ATAReg;
+using ata::TransferMode;
+using ata::bus::TransferStatus;
+
+static const PIO ata_pio = pio0;
+static int ata_read_pio_sm = -1, ata_write_pio_sm = -1;
+static int ata_dma_read_pio_sm = -1, ata_dma_write_pio_sm = -1;
+static int ata_read_dma_chan = -1, ata_write_dma_chan = -1;
+
+// programs for the DMA SMs are loaded when a DMA mode is selected
+static const pio_program *dma_read_program = nullptr, *dma_write_program = nullptr;
+static int dma_read_program_offset = -1, dma_write_program_offset = -1;
+static int dma_sideset_bits = 1; // all high when idle
+
+// the DMA read SM runs the status poll program in PIO mode instead
+static int status_poll_program_offset = -1;
+
+// PIO modes and cycle time set by set_pio_timing
+// register access is seen by both devices, so it may be slower than the data timing of the selected one
+static int pio_timing_mode = 0, pio_register_timing_mode = 0, pio_min_cycle_time = 600;
+
+// clock dividers (24.8 fixed point), the PIO SMs switch between these for register and data access
+static uint32_t pio_read_register_clkdiv = 256, pio_write_register_clkdiv = 256;
+static uint32_t pio_read_data_clkdiv = 256, pio_write_data_clkdiv = 256;
+static bool pio_data_timing_active = false;
+
+// clk_sys the dividers were calculated for
+static uint32_t clkdiv_sys_clock_hz = 0;
+
+static TransferMode data_transfer_mode = TransferMode::PIO;
+static int data_transfer_mode_num = 0;
+
+// the DMA programs have a 16-bit word count
+static const int max_dma_chunk_words = 0x10000;
+
+// DMA mode transfer, may be split into multiple chunks/bursts
+static bool dma_write;
+static uint16_t *dma_read_data;
+static const uint16_t *dma_write_data;
+static int dma_words, dma_words_done, dma_chunk_words;
+
+#ifdef ATA_INTRQ_PIN
+static bool interrupts_enabled = false;
+static volatile bool interrupt_pending = false;
+#endif
+
+// UDMA CRC-16 (x^16 + x^12 + x^5 + 1), DD0 first
+static const uint16_t udma_crc_seed = 0x4ABA;
+
+static_assert(ATA_CS_PIN_BASE == ATA_DATA_PIN_BASE + 16, "pio_write outputs CS0-1/DA0-2 with the data");
+static_assert(ATA_ADDR_PIN_BASE == ATA_CS_PIN_BASE + 2, "pio_read/pio_write output CS0-1/DA0-2 together");
+static_assert(ATA_WRITE_PIN == ATA_READ_PIN + 1, "UDMA programs side-set DIOR- and DIOW- together");
+static_assert(ATA_DMARQ_PIN == ATA_IORDY_PIN + 1, "UDMA programs wait on DMARQ relative to IORDY");
+
+// in-progress data transfer
+static int active_dma_chan = -1, active_sm = -1;
+
+// PIO mode timing (ns)
+struct PIOTiming
+{
+    int t0;   // cycle time
+    int t1;   // address valid to DIOR-/DIOW- setup
+    int t2;   // DIOR-/DIOW- pulse width
+    int t2i;  // DIOR-/DIOW- recovery time
+    int teoc; // address hold after DIOR-/DIOW- negated (t9)
+};
+
+// modes 0-2 have longer cycles/pulses for register (8-bit) access than for the data register
+static const PIOTiming pio_data_timing[]
+{
+    {600, 70, 165,  0, 20},
+    {383, 50, 125,  0, 15},
+    {240, 30, 100,  0, 10},
+    {180, 30,  80, 70, 10},
+    {120, 25,  70, 25, 10},
+};
+
+static const PIOTiming pio_register_timing[]
+{
+    {600, 70, 290,  0, 20},
+    {383, 50, 290,  0, 15},
+    {330, 30, 290,  0, 10},
+    {180, 30,  80, 70, 10},
+    {120, 25,  70, 25, 10},
+};
+
+// a minimum time that has to be covered by a number of PIO cycles
+struct ClockConstraint
+{
+    int time_ns;
+    int cycles;
+};
+
+// with a fractional divider individual cycles are either floor(div) or ceil(div) system clocks,
+// but any n consecutive cycles take at least floor(n * div), so we only need n * div >= system clocks for the time
+static uint32_t calculate_clkdiv(std::initializer_list<ClockConstraint> constraints)
+{
+    uint64_t sys_hz = clock_get_hz(clk_sys);
+
+    uint32_t clkdiv = 1 << 8;
+
+    for(auto &constraint : constraints)
+    {
+        uint32_t sys_clocks = (constraint.time_ns * sys_hz + 999999999) / 1000000000;
+        uint32_t div = ((sys_clocks << 8) + constraint.cycles - 1) / constraint.cycles;
+        clkdiv = std::max(clkdiv, div);
+    }
+
+    return std::min(clkdiv, 0xFFFFFFu);
+}
+
+// pio_read is 6 instructions per word and pio_write is 8, both with DIOR-/DIOW- asserted for 4
+// pio_read sets the address 2 instructions before asserting DIOR- and pio_write 1 before DIOW-
+// (the data register address is set before starting a data write)
+// the address is held for at least 2 instructions after negating DIOR- and 3 after DIOW-
+static uint32_t calculate_pio_clkdiv(const PIOTiming &timing, int min_cycle_time, bool write, bool data)
+{
+    int loop_cycles = write ? 8 : 6;
+
+    return calculate_clkdiv({
+        {std::max(timing.t0, min_cycle_time), loop_cycles},
+        {write && data ? 0 : timing.t1, write ? 1 : 2},
+        {timing.t2, 4},
+        {timing.t2i, loop_cycles - 4},
+        {timing.teoc, write ? 3 : 2}
+    });
+}
+
+static uint32_t calculate_mwdma_clkdiv(int mode)
+{
+    // t0, tD, tKW (tKR is shorter)
+    static const int cycle_time[]{480, 150, 120};
+    static const int asserted_time[]{215, 80, 70};
+    static const int negated_time[]{215, 50, 25};
+
+    // 7 instructions per word, DIOR/DIOW asserted for 4 of them
+    return calculate_clkdiv({{cycle_time[mode], 7}, {asserted_time[mode], 4}, {negated_time[mode], 3}});
+}
+
+// min data setup time at the recipient (tDS), also limits the mode we can read with
+static const int udma_data_setup_time[]{15, 10, 7, 7, 5, 4};
+
+static uint32_t calculate_udma_write_clkdiv(int mode)
+{
+    // tCYC, tDVS, tDVH
+    static const int cycle_time[]{112, 73, 54, 39, 25, 17};
+    static const int setup_time[]{70, 48, 31, 20, 7, 5};
+    static const int hold_time[]{7, 7, 7, 7, 7, 5};
+
+    // 4 instructions per word, data set up 2 before the strobe edge and held for 2 after
+    return calculate_clkdiv({{cycle_time[mode], 4}, {setup_time[mode], 2}, {hold_time[mode], 2}});
+}
+
+static uint16_t calculate_udma_crc(const uint16_t *data, int count, uint16_t crc = udma_crc_seed)
+{
+    for(int i = 0; i < count; i++)
+    {
+        for(int bit = 0; bit < 16; bit++)
+        {
+            bool feedback = ((crc >> 15) ^ (data[i] >> bit)) & 1;
+            crc <<= 1;
+            if(feedback)
+                crc ^= 0x1021;
+        }
+    }
+
+    return crc;
+}
+
+// DMA between the PIO FIFOs and memory
+static void start_read_dma(int sm, uint16_t *data, int count, bool sniff = false)
+{
+    auto config = dma_get_channel_config(ata_read_dma_chan);
+    channel_config_set_dreq(&config, pio_get_dreq(ata_pio, sm, false));
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+    channel_config_set_sniff_enable(&config, sniff);
+    dma_channel_configure(ata_read_dma_chan, &config, data, &ata_pio->rxf[sm], count, true);
+
+    active_dma_chan = ata_read_dma_chan;
+    active_sm = sm;
+}
+
+static void start_write_dma(int sm, const uint16_t *data, int count, bool sniff = false)
+{
+    auto config = dma_get_channel_config(ata_write_dma_chan);
+    channel_config_set_dreq(&config, pio_get_dreq(ata_pio, sm, true));
+    channel_config_set_sniff_enable(&config, sniff);
+    dma_channel_configure(ata_write_dma_chan, &config, &ata_pio->txf[sm], data, count, true);
+
+    active_dma_chan = ata_write_dma_chan;
+    active_sm = sm;
+}
+
+static void set_dma_data_output(bool output)
+{
+    auto sideset = pio_encode_sideset(dma_sideset_bits, (1 << dma_sideset_bits) - 1);
+
+    if(output)
+        pio_sm_exec(ata_pio, ata_dma_write_pio_sm, pio_encode_mov_not(pio_pindirs, pio_null) | sideset);
+    else
+        pio_sm_exec(ata_pio, ata_dma_write_pio_sm, pio_encode_mov(pio_pindirs, pio_null) | sideset);
+}
+
+static void unload_dma_programs()
+{
+    if(!dma_read_program)
+        return;
+
+    pio_set_sm_mask_enabled(ata_pio, 1 << ata_dma_read_pio_sm | 1 << ata_dma_write_pio_sm, false);
+
+    pio_remove_program(ata_pio, dma_read_program, dma_read_program_offset);
+    pio_remove_program(ata_pio, dma_write_program, dma_write_program_offset);
+
+    dma_read_program = dma_write_program = nullptr;
+    dma_read_program_offset = dma_write_program_offset = -1;
+
+    // only bypassed for UDMA
+    ata_pio->input_sync_bypass &= ~ATA_IORDY_PIN_MASK;
+}
+
+static void status_poll_irq_handler()
+{
+    // the source is level triggered, so disable it until the next poll
+    pio_set_irq0_source_enabled(ata_pio, pio_get_rx_fifo_not_empty_interrupt_source(ata_dma_read_pio_sm), false);
+
+    // wake up the command engine
+    __sev();
+}
+
+static void load_status_poll_program()
+{
+    if(status_poll_program_offset != -1)
+        return;
+
+    status_poll_program_offset = pio_add_program(ata_pio, &status_poll_program);
+
+    pio_sm_config c = status_poll_program_get_default_config(status_poll_program_offset);
+
+    sm_config_set_in_shift(&c, true, true, 32); // status, data
+    sm_config_set_out_shift(&c, false, false, 32); // addresses, read count
+
+    sm_config_set_in_pins(&c, ATA_DATA_PIN_BASE);
+    sm_config_set_out_pins(&c, ATA_CS_PIN_BASE, 5);
+    sm_config_set_sideset_pins(&c, ATA_READ_PIN);
+    sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+
+    // this reads the status register, so use the register timing for everything
+    sm_config_set_clkdiv_int_frac8(&c, pio_read_register_clkdiv >> 8, pio_read_register_clkdiv & 0xFF);
+
+    pio_sm_init(ata_pio, ata_dma_read_pio_sm, status_poll_program_offset, &c);
+    pio_sm_set_enabled(ata_pio, ata_dma_read_pio_sm, true);
+}
+
+static void unload_status_poll_program()
+{
+    if(status_poll_program_offset == -1)
+        return;
+
+    pio_sm_set_enabled(ata_pio, ata_dma_read_pio_sm, false);
+    pio_remove_program(ata_pio, &status_poll_program, status_poll_program_offset);
+    status_poll_program_offset = -1;
+}
+
+static void setup_multiword_dma(int mode)
+{
+    unload_dma_programs();
+    unload_status_poll_program();
+
+    dma_read_program = &mwdma_read_program;
+    dma_write_program = &mwdma_write_program;
+    dma_read_program_offset = pio_add_program(ata_pio, dma_read_program);
+    dma_write_program_offset = pio_add_program(ata_pio, dma_write_program);
+    dma_sideset_bits = 1;
+
+    uint32_t clkdiv = calculate_mwdma_clkdiv(mode);
+
+    // configure read program
+    pio_sm_config c = mwdma_read_program_get_default_config(dma_read_program_offset);
+
+    sm_config_set_in_shift(&c, false, true, 16); // data
+    sm_config_set_out_shift(&c, false, true, 16); // read count
+
+    sm_config_set_in_pins(&c, ATA_DATA_PIN_BASE);
+    sm_config_set_set_pins(&c, ATA_DMACK_PIN, 1);
+    sm_config_set_sideset_pins(&c, ATA_READ_PIN);
+    sm_config_set_jmp_pin(&c, ATA_DMARQ_PIN);
+
+    sm_config_set_clkdiv_int_frac8(&c, clkdiv >> 8, clkdiv & 0xFF);
+
+    pio_sm_init(ata_pio, ata_dma_read_pio_sm, dma_read_program_offset, &c);
+
+    // configure write program
+    c = mwdma_write_program_get_default_config(dma_write_program_offset);
+
+    sm_config_set_out_shift(&c, false, true, 16); // write count, data
+
+    sm_config_set_out_pins(&c, ATA_DATA_PIN_BASE, 16);
+    sm_config_set_set_pins(&c, ATA_DMACK_PIN, 1);
+    sm_config_set_sideset_pins(&c, ATA_WRITE_PIN);
+    sm_config_set_jmp_pin(&c, ATA_DMARQ_PIN);
+
+    sm_config_set_clkdiv_int_frac8(&c, clkdiv >> 8, clkdiv & 0xFF);
+
+    pio_sm_init(ata_pio, ata_dma_write_pio_sm, dma_write_program_offset, &c);
+
+    pio_set_sm_mask_enabled(ata_pio, 1 << ata_dma_read_pio_sm | 1 << ata_dma_write_pio_sm, true);
+}
+
+static void setup_ultra_dma(int mode)
+{
+    unload_dma_programs();
+    unload_status_poll_program();
+
+    dma_read_program = &udma_read_program;
+    dma_write_program = &udma_write_program;
+    dma_read_program_offset = pio_add_program(ata_pio, dma_read_program);
+    dma_write_program_offset = pio_add_program(ata_pio, dma_write_program);
+    dma_sideset_bits = 2;
+
+    // configure read program
+    // this runs as fast as possible, the device controls the timing with DSTROBE
+    pio_sm_config c = udma_read_program_get_default_config(dma_read_program_offset);
+
+    sm_config_set_in_shift(&c, false, true, 16); // data
+
+    sm_config_set_in_pins(&c, ATA_DATA_PIN_BASE);
+    sm_config_set_set_pins(&c, ATA_DMACK_PIN, 1);
+    sm_config_set_sideset_pins(&c, ATA_READ_PIN);
+    sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+
+    // the data is latched on both edges, join the FIFOs to give the DMA more slack
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+
+    pio_sm_init(ata_pio, ata_dma_read_pio_sm, dma_read_program_offset, &c);
+
+    // configure write program
+    c = udma_write_program_get_default_config(dma_write_program_offset);
+
+    sm_config_set_out_shift(&c, false, true, 16); // write count, data, CRC
+    sm_config_set_in_shift(&c, false, false, 32); // remaining count
+
+    sm_config_set_out_pins(&c, ATA_DATA_PIN_BASE, 16);
+    sm_config_set_set_pins(&c, ATA_DMACK_PIN, 1);
+    sm_config_set_sideset_pins(&c, ATA_READ_PIN);
+    sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+
+    uint32_t clkdiv = calculate_udma_write_clkdiv(mode);
+    sm_config_set_clkdiv_int_frac8(&c, clkdiv >> 8, clkdiv & 0xFF);
+
+    pio_sm_init(ata_pio, ata_dma_write_pio_sm, dma_write_program_offset, &c);
+
+    // skip the synchroniser on the strobe so the data is sampled just before the edge instead of after it
+    // (the data pins are still synchronised)
+    ata_pio->input_sync_bypass |= ATA_IORDY_PIN_MASK;
+
+    pio_set_sm_mask_enabled(ata_pio, 1 << ata_dma_read_pio_sm | 1 << ata_dma_write_pio_sm, true);
+}
+
+#ifdef ATA_INTRQ_PIN
+static void intrq_irq_handler()
+{
+    if(gpio_get_irq_event_mask(ATA_INTRQ_PIN) & GPIO_IRQ_EDGE_RISE)
+    {
+        gpio_acknowledge_irq(ATA_INTRQ_PIN, GPIO_IRQ_EDGE_RISE);
+        interrupt_pending = true;
+
+        // wake up the command engine (which may be on the other core)
+        __sev();
+    }
+}
+#endif
+
+// CS0-1/DA0-2 pin values for a register, relative to ATA_CS_PIN_BASE
+static uint32_t register_address_bits(ATAReg reg)
+{
+    return static_cast<int>(reg) >> 3 | (static_cast<int>(reg) & 7) << 2;
+}
+
+// sets the address using the write SM, which should be stalled
+static void set_address(uint32_t address_bits)
+{
+    pio_sm_exec(ata_pio, ata_write_pio_sm, pio_encode_set(pio_pins, address_bits) | pio_encode_sideset(1, 1));
+}
+
+// switches the timing and the write SM outputs between register and data access
+// the SMs should be stalled
+static void use_pio_data_timing(bool data)
+{
+    if(data == pio_data_timing_active)
+        return;
+
+    // data transfers leave the address alone so that DMA can write 16-bit words
+    pio_sm_set_out_pins(ata_pio, ata_write_pio_sm, ATA_DATA_PIN_BASE, data ? 16 : 21);
+
+    uint32_t read_clkdiv = data ? pio_read_data_clkdiv : pio_read_register_clkdiv;
+    uint32_t write_clkdiv = data ? pio_write_data_clkdiv : pio_write_register_clkdiv;
+
+    pio_sm_set_clkdiv_int_frac8(ata_pio, ata_read_pio_sm, read_clkdiv >> 8, read_clkdiv & 0xFF);
+    pio_sm_set_clkdiv_int_frac8(ata_pio, ata_write_pio_sm, write_clkdiv >> 8, write_clkdiv & 0xFF);
+
+    pio_data_timing_active = data;
+}
+
+static void update_pio_clkdivs()
+{
+    // the device's min cycle time only applies to data transfers
+    pio_read_register_clkdiv = calculate_pio_clkdiv(pio_register_timing[pio_register_timing_mode], 0, false, false);
+    pio_write_register_clkdiv = calculate_pio_clkdiv(pio_register_timing[pio_register_timing_mode], 0, true, false);
+    pio_read_data_clkdiv = calculate_pio_clkdiv(pio_data_timing[pio_timing_mode], pio_min_cycle_time, false, true);
+    pio_write_data_clkdiv = calculate_pio_clkdiv(pio_data_timing[pio_timing_mode], pio_min_cycle_time, true, true);
+
+    // reapply the current set
+    bool data = pio_data_timing_active;
+    pio_data_timing_active = !data;
+    use_pio_data_timing(data);
+
+    if(status_poll_program_offset != -1)
+        pio_sm_set_clkdiv_int_frac8(ata_pio, ata_dma_read_pio_sm, pio_read_register_clkdiv >> 8, pio_read_register_clkdiv & 0xFF);
+
+    clkdiv_sys_clock_hz = clock_get_hz(clk_sys);
+}
+
+// recalculate all the dividers if clk_sys has changed (overclocking)
+// this is called on every register access, but left until the next one while a data transfer is running
+// (the UDMA mode itself is stepped down by ata before the command, as the device has to be told)
+static void check_sys_clock()
+{
+    if(clock_get_hz(clk_sys) == clkdiv_sys_clock_hz || active_dma_chan != -1)
+        return;
+
+    update_pio_clkdivs();
+
+    if(data_transfer_mode == TransferMode::MultiwordDMA)
+    {
+        uint32_t clkdiv = calculate_mwdma_clkdiv(data_transfer_mode_num);
+        pio_sm_set_clkdiv_int_frac8(ata_pio, ata_dma_read_pio_sm, clkdiv >> 8, clkdiv & 0xFF);
+        pio_sm_set_clkdiv_int_frac8(ata_pio, ata_dma_write_pio_sm, clkdiv >> 8, clkdiv & 0xFF);
+    }
+    else if(data_transfer_mode == TransferMode::UltraDMA)
+    {
+        uint32_t clkdiv = calculate_udma_write_clkdiv(data_transfer_mode_num);
+        pio_sm_set_clkdiv_int_frac8(ata_pio, ata_dma_write_pio_sm, clkdiv >> 8, clkdiv & 0xFF);
+    }
+}
+
+// CS must be negated during DMA transfers
+static void negate_cs()
+{
+    set_address(ATA_CS_PIN_MASK >> ATA_CS_PIN_BASE);
+}
+
+// host side of UDMA burst termination, the SMs are stopped and driven directly
+// (the device has either stopped or will stop once it sees STOP)
+static bool end_udma_burst(int sm, uint16_t crc)
+{
+    // the write SM drives the bus for both directions so the read SM can have both FIFOs
+    int term_sm = ata_dma_write_pio_sm;
+
+    pio_sm_set_enabled(ata_pio, sm, false);
+    pio_sm_set_enabled(ata_pio, term_sm, false);
+
+    auto sideset = pio_encode_sideset(2, 0b11);
+
+    if(sm == ata_dma_read_pio_sm)
+    {
+        // negate HDMARDY- first, then assert STOP after tRP (160ns at most)
+        pio_sm_exec(ata_pio, term_sm, pio_encode_nop() | pio_encode_sideset(2, 0b01));
+        busy_wait_us_32(1);
+        pio_sm_exec(ata_pio, term_sm, pio_encode_nop() | sideset);
+    }
+    else
+    {
+        // assert STOP first, then negate HSTROBE
+        pio_sm_exec(ata_pio, term_sm, pio_encode_nop() | pio_encode_sideset(2, 0b10 | gpio_get(ATA_READ_PIN)));
+        pio_sm_exec(ata_pio, term_sm, pio_encode_nop() | sideset);
+    }
+
+    auto timeout_time = make_timeout_time_ms(1);
+    while(gpio_get(ATA_DMARQ_PIN))
+    {
+        if(time_reached(timeout_time))
+            return false;
+    }
+
+    // drive the CRC, the device latches it when DMACK is negated
+    pio_sm_put(ata_pio, term_sm, crc << 16);
+    pio_sm_exec(ata_pio, term_sm, pio_encode_pull(false, false) | sideset);
+    pio_sm_exec(ata_pio, term_sm, pio_encode_out(pio_pins, 16) | sideset);
+    pio_sm_exec(ata_pio, term_sm, pio_encode_mov_not(pio_pindirs, pio_null) | sideset);
+    pio_sm_exec(ata_pio, term_sm, pio_encode_set(pio_pins, 1) | sideset);
+
+    // write leaves the bus driven for the next burst
+    if(sm == ata_dma_read_pio_sm)
+        pio_sm_exec(ata_pio, term_sm, pio_encode_mov(pio_pindirs, pio_null) | sideset);
+
+    // back to the start, ready for the next burst
+    pio_sm_restart(ata_pio, sm);
+    pio_sm_exec(ata_pio, sm, pio_encode_jmp(sm == ata_dma_read_pio_sm ? dma_read_program_offset : dma_write_program_offset));
+    pio_sm_set_enabled(ata_pio, sm, true);
+
+    if(term_sm != sm)
+    {
+        pio_sm_restart(ata_pio, term_sm);
+        pio_sm_exec(ata_pio, term_sm, pio_encode_jmp(dma_write_program_offset));
+        pio_sm_set_enabled(ata_pio, term_sm, true);
+    }
+
+    return true;
+}
+
+static bool in_udma_burst()
+{
+    // DMACK asserted
+    return !gpio_get(ATA_DMACK_PIN);
+}
+
+static TransferStatus update_udma_read(absolute_time_t timeout_time)
+{
+    bool done = !dma_channel_is_busy(ata_read_dma_chan);
+
+    // end the burst if the device did or we have everything
+    if(in_udma_burst() && (done || !gpio_get(ATA_DMARQ_PIN)))
+    {
+        // let the DMA catch up (this never happens if the device sent more than expected)
+        while(!pio_sm_is_rx_fifo_empty(ata_pio, ata_dma_read_pio_sm))
+        {
+            if(time_reached(timeout_time))
+                return TransferStatus::Failed;
+        }
+
+        done = !dma_channel_is_busy(ata_read_dma_chan);
+
+        if(!end_udma_burst(ata_dma_read_pio_sm, dma_sniffer_get_data_accumulator()))
+            return TransferStatus::Failed;
+
+        if(done)
+        {
+            active_dma_chan = active_sm = -1;
+            return TransferStatus::Done;
+        }
+
+        dma_sniffer_set_data_accumulator(udma_crc_seed);
+    }
+
+    return TransferStatus::Running;
+}
+
+// setup a burst for everything that's left (up to the max the SM can count)
+static void start_udma_write_burst()
+{
+    dma_chunk_words = std::min(dma_words - dma_words_done, max_dma_chunk_words);
+
+    dma_sniffer_enable(ata_write_dma_chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC16R, true);
+    dma_sniffer_set_data_accumulator(udma_crc_seed);
+
+    pio_sm_put_blocking(ata_pio, ata_dma_write_pio_sm, (dma_chunk_words - 1) << 16);
+    start_write_dma(ata_dma_write_pio_sm, dma_write_data + dma_words_done, dma_chunk_words, true);
+}
+
+static TransferStatus update_udma_write()
+{
+    // wait for either side to end the burst
+    if(!in_udma_burst() || gpio_get(ATA_DMARQ_PIN))
+        return TransferStatus::Running;
+
+    // get the remaining count to work out how much was actually sent
+    pio_sm_set_enabled(ata_pio, ata_dma_write_pio_sm, false);
+    pio_sm_exec(ata_pio, ata_dma_write_pio_sm, pio_encode_mov(pio_isr, pio_x) | pio_encode_sideset(2, 0b11));
+    pio_sm_exec(ata_pio, ata_dma_write_pio_sm, pio_encode_push(false, false) | pio_encode_sideset(2, 0b11));
+    int burst_sent = dma_chunk_words - 1 - int(pio_sm_get(ata_pio, ata_dma_write_pio_sm));
+
+    // anything the DMA read ahead is sent again in the next burst
+    dma_channel_abort(ata_write_dma_chan);
+    pio_sm_clear_fifos(ata_pio, ata_dma_write_pio_sm);
+
+    // the sniffer is only right if the burst sent everything the DMA read
+    uint16_t crc;
+    if(burst_sent == dma_chunk_words)
+        crc = dma_sniffer_get_data_accumulator();
+    else
+        crc = calculate_udma_crc(dma_write_data + dma_words_done, burst_sent);
+
+    if(!end_udma_burst(ata_dma_write_pio_sm, crc))
+        return TransferStatus::Failed;
+
+    dma_words_done += burst_sent;
+
+    if(dma_words_done < dma_words)
+    {
+        start_udma_write_burst();
+        return TransferStatus::Running;
+    }
+
+    active_dma_chan = active_sm = -1;
+    set_dma_data_output(false);
+
+    return TransferStatus::Done;
+}
+
+// DMACK is negated between chunks, which looks like a pause to the device
+static void start_mwdma_chunk()
+{
+    dma_chunk_words = std::min(dma_words - dma_words_done, max_dma_chunk_words);
+
+    if(dma_write)
+    {
+        pio_sm_put_blocking(ata_pio, ata_dma_write_pio_sm, (dma_chunk_words - 1) << 16);
+        start_write_dma(ata_dma_write_pio_sm, dma_write_data + dma_words_done, dma_chunk_words);
+    }
+    else
+    {
+        start_read_dma(ata_dma_read_pio_sm, dma_read_data + dma_words_done, dma_chunk_words);
+        pio_sm_put_blocking(ata_pio, ata_dma_read_pio_sm, (dma_chunk_words - 1) << 16);
+    }
+}
+
+static TransferStatus update_mwdma()
+{
+    if(!ata::bus::is_transfer_done())
+        return TransferStatus::Running;
+
+    ata::bus::finish_transfer(~0u);
+
+    dma_words_done += dma_chunk_words;
+
+    if(dma_words_done < dma_words)
+    {
+        start_mwdma_chunk();
+        return TransferStatus::Running;
+    }
+
+    if(dma_write)
+        set_dma_data_output(false);
+
+    return TransferStatus::Done;
+}
+
+namespace ata::bus
+{
+    void init()
+    {
+        // setup all the IO
+        gpio_init_mask(ATA_IO_MASK);
+
+        // init the active low reset
+        gpio_put(ATA_RESET_PIN, true);
+        gpio_set_dir(ATA_RESET_PIN, true);
+
+        // PIO init
+        int read_program_offset = pio_add_program(pio0, &pio_read_program);
+        int write_program_offset = pio_add_program(pio0, &pio_write_program);
+        ata_read_pio_sm = pio_claim_unused_sm(ata_pio, true);
+        ata_write_pio_sm = pio_claim_unused_sm(ata_pio, true);
+        ata_dma_read_pio_sm = pio_claim_unused_sm(ata_pio, true);
+        ata_dma_write_pio_sm = pio_claim_unused_sm(ata_pio, true);
+
+        // setup read/write pins
+        uint32_t rw_mask = ATA_READ_PIN_MASK | ATA_WRITE_PIN_MASK;
+        pio_sm_set_pins_with_mask(ata_pio, ata_read_pio_sm, rw_mask, rw_mask);
+        pio_sm_set_pindirs_with_mask(ata_pio, ata_read_pio_sm, rw_mask, rw_mask);
+        pio_gpio_init(ata_pio, ATA_READ_PIN);
+        pio_gpio_init(ata_pio, ATA_WRITE_PIN);
+
+        // setup address pins (CS negated)
+        uint32_t addr_mask = ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK;
+        pio_sm_set_pins_with_mask(ata_pio, ata_read_pio_sm, ATA_CS_PIN_MASK, addr_mask);
+        pio_sm_set_pindirs_with_mask(ata_pio, ata_read_pio_sm, addr_mask, addr_mask);
+        for(int i = 0; i < 5; i++)
+            pio_gpio_init(ata_pio, ATA_CS_PIN_BASE + i);
+
+        // setup data bus
+        pio_sm_set_pindirs_with_mask(ata_pio, ata_read_pio_sm, 0, ATA_DATA_PIN_MASK);
+        for(int i = 0; i < 16; i++)
+            pio_gpio_init(ata_pio, ATA_DATA_PIN_BASE + i);
+
+        // setup DMA handshake (DMACK is driven by the DMA SMs)
+        gpio_pull_down(ATA_DMARQ_PIN);
+        pio_sm_set_pins_with_mask(ata_pio, ata_dma_read_pio_sm, ATA_DMACK_PIN_MASK, ATA_DMACK_PIN_MASK);
+        pio_sm_set_pindirs_with_mask(ata_pio, ata_dma_read_pio_sm, ATA_DMACK_PIN_MASK, ATA_DMACK_PIN_MASK);
+        pio_gpio_init(ata_pio, ATA_DMACK_PIN);
+
+#ifdef ATA_INTRQ_PIN
+        // INTRQ is only driven while nIEN is clear
+        gpio_pull_down(ATA_INTRQ_PIN);
+        gpio_add_raw_irq_handler(ATA_INTRQ_PIN, intrq_irq_handler);
+        gpio_set_irq_enabled(ATA_INTRQ_PIN, GPIO_IRQ_EDGE_RISE, true);
+        irq_set_enabled(IO_IRQ_BANK0, true);
+#endif
+
+        // configure read program
+        pio_sm_config c = pio_read_program_get_default_config(read_program_offset);
+
+        sm_config_set_in_shift(&c, false, true, 16); // data
+        sm_config_set_out_shift(&c, false, true, 21); // address, read count
+
+        sm_config_set_in_pins(&c, ATA_DATA_PIN_BASE);
+        sm_config_set_out_pins(&c, ATA_CS_PIN_BASE, 5);
+        sm_config_set_sideset_pins(&c, ATA_READ_PIN);
+        sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+
+        pio_sm_init(ata_pio, ata_read_pio_sm, read_program_offset, &c);
+
+        // configure write program
+        c = pio_write_program_get_default_config(write_program_offset);
+
+        sm_config_set_out_shift(&c, true, false, 32); // data, address
+
+        sm_config_set_out_pins(&c, ATA_DATA_PIN_BASE, 21);
+        sm_config_set_set_pins(&c, ATA_CS_PIN_BASE, 5);
+        sm_config_set_sideset_pins(&c, ATA_WRITE_PIN);
+        sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+
+        // no reads, so the extra FIFO space lets a whole taskfile be queued
+        sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+
+        pio_sm_init(ata_pio, ata_write_pio_sm, write_program_offset, &c);
+
+        // y is the pindirs to restore after a write
+        pio_sm_put(ata_pio, ata_write_pio_sm, addr_mask >> ATA_DATA_PIN_BASE);
+        pio_sm_exec(ata_pio, ata_write_pio_sm, pio_encode_pull(false, true) | pio_encode_sideset(1, 1));
+        pio_sm_exec(ata_pio, ata_write_pio_sm, pio_encode_out(pio_y, 32) | pio_encode_sideset(1, 1));
+
+        // start with PIO mode 0 timing
+        set_pio_timing(600, 600);
+
+        // the DMA SMs are unused until a DMA mode is set
+        load_status_poll_program();
+
+        irq_set_exclusive_handler(pio_get_irq_num(ata_pio, 0), status_poll_irq_handler);
+        irq_set_enabled(pio_get_irq_num(ata_pio, 0), true);
+
+        // DMA for data transfers
+        ata_read_dma_chan = dma_claim_unused_channel(true);
+        ata_write_dma_chan = dma_claim_unused_channel(true);
+
+        // the SM/DREQ is set when a transfer is started
+        // data is in the low 16 bits of the RX FIFO
+        auto dma_config = dma_channel_get_default_config(ata_read_dma_chan);
+        channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_16);
+        channel_config_set_read_increment(&dma_config, false);
+        channel_config_set_write_increment(&dma_config, true);
+        dma_channel_set_config(ata_read_dma_chan, &dma_config, false);
+
+        // 16-bit writes are replicated across the bus, so the data also ends up in the high half the programs shift out from
+        dma_config = dma_channel_get_default_config(ata_write_dma_chan);
+        channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_16);
+        channel_config_set_read_increment(&dma_config, true);
+        channel_config_set_write_increment(&dma_config, false);
+        dma_channel_set_config(ata_write_dma_chan, &dma_config, false);
+    }
+
+    void hardware_reset()
+    {
+        gpio_put(ATA_RESET_PIN, false);
+        sleep_us(25);
+
+        gpio_put(ATA_RESET_PIN, true);
+    }
+
+    void set_pio_timing(int min_cycle_time, int register_min_cycle_time)
+    {
+        // the DMA dividers too, the early return below would skip them
+        check_sys_clock();
+
+        // fastest modes the cycle times allow
+        int mode = 4;
+        while(mode > 0 && pio_data_timing[mode].t0 < min_cycle_time)
+            mode--;
+
+        int register_mode = 4;
+        while(register_mode > 0 && pio_data_timing[register_mode].t0 < register_min_cycle_time)
+            register_mode--;
+
+        // switching between devices with the same timing (the dividers are calculated on the first call)
+        if(clkdiv_sys_clock_hz && mode == pio_timing_mode && register_mode == pio_register_timing_mode && min_cycle_time == pio_min_cycle_time)
+            return;
+
+        pio_timing_mode = mode;
+        pio_register_timing_mode = register_mode;
+        pio_min_cycle_time = min_cycle_time;
+
+        pio_set_sm_mask_enabled(ata_pio, 1 << ata_read_pio_sm | 1 << ata_write_pio_sm, false);
+
+        update_pio_clkdivs();
+
+        pio_set_sm_mask_enabled(ata_pio, 1 << ata_read_pio_sm | 1 << ata_write_pio_sm, true);
+    }
+
+    uint16_t read_register(ATAReg reg)
+    {
+        check_sys_clock();
+
+        use_pio_data_timing(false);
+
+        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + ata_read_pio_sm);
+
+        // address, count = 1
+        pio_sm_put_blocking(ata_pio, ata_read_pio_sm, register_address_bits(reg) << 27);
+        ata_pio->fdebug |= stall_mask;
+
+        // get result
+        uint16_t data = pio_sm_get_blocking(ata_pio, ata_read_pio_sm);
+
+        // wait for stall
+        while(!(ata_pio->fdebug & stall_mask));
+
+        return data;
+    }
+
+    void write_registers(const RegisterWrite *writes, int count)
+    {
+        check_sys_clock();
+
+        use_pio_data_timing(false);
+
+        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + ata_write_pio_sm);
+
+        for(int i = 0; i < count; i++)
+            pio_sm_put_blocking(ata_pio, ata_write_pio_sm, register_address_bits(writes[i].reg) << 16 | writes[i].data);
+
+        // wait for stall
+        ata_pio->fdebug |= stall_mask;
+        while(!(ata_pio->fdebug & stall_mask));
+    }
+
+    void start_pio_read(uint16_t *data, int count)
+    {
+        assert(count > 0);
+        assert(count <= 0x10000);
+
+        use_pio_data_timing(true);
+
+        // start the DMA before the count so the SM never waits on a full FIFO
+        start_read_dma(ata_read_pio_sm, data, count);
+
+        pio_sm_put_blocking(ata_pio, ata_read_pio_sm, register_address_bits(ATAReg::Data) << 27 | (count - 1) << 11);
+    }
+
+    void start_pio_write(const uint16_t *data, int count)
+    {
+        assert(count > 0);
+
+        use_pio_data_timing(true);
+
+        set_address(register_address_bits(ATAReg::Data));
+
+        start_write_dma(ata_write_pio_sm, data, count);
+    }
+
+    bool is_transfer_done()
+    {
+        return active_dma_chan == -1 || !dma_channel_is_busy(active_dma_chan);
+    }
+
+    bool finish_transfer(uint32_t timeout_ms)
+    {
+        if(active_dma_chan == -1)
+            return true;
+
+        auto timeout_time = make_timeout_time_ms(timeout_ms);
+
+        while(dma_channel_is_busy(active_dma_chan))
+        {
+            if(time_reached(timeout_time))
+                return false;
+        }
+
+        // the last few words may still be in the FIFO (write) or on the bus (read)
+        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + active_sm);
+        ata_pio->fdebug = stall_mask;
+        while(!(ata_pio->fdebug & stall_mask));
+
+        active_dma_chan = active_sm = -1;
+
+        return true;
+    }
+
+    void abort_transfer()
+    {
+        if(active_dma_chan == -1)
+            return;
+
+        dma_channel_abort(active_dma_chan);
+
+        if(active_sm == ata_dma_read_pio_sm && status_poll_program_offset != -1)
+        {
+            reset_status_poll();
+            active_dma_chan = active_sm = -1;
+            return;
+        }
+
+        int offset = active_sm == ata_dma_read_pio_sm ? dma_read_program_offset : dma_write_program_offset;
+
+        pio_sm_set_enabled(ata_pio, active_sm, false);
+        pio_sm_clear_fifos(ata_pio, active_sm);
+        pio_sm_restart(ata_pio, active_sm);
+        pio_sm_exec(ata_pio, active_sm, pio_encode_jmp(offset));
+
+        // release DMACK and the bus
+        pio_sm_exec(ata_pio, active_sm, pio_encode_set(pio_pins, 1) | pio_encode_sideset(dma_sideset_bits, (1 << dma_sideset_bits) - 1));
+        if(active_sm == ata_dma_write_pio_sm)
+            set_dma_data_output(false);
+
+        pio_sm_set_enabled(ata_pio, active_sm, true);
+
+        active_dma_chan = active_sm = -1;
+    }
+
+    bool has_status_poll()
+    {
+        return status_poll_program_offset != -1;
+    }
+
+    void start_status_poll(int count)
+    {
+        assert(count <= 0x10000);
+
+        pio_set_irq0_source_enabled(ata_pio, pio_get_rx_fifo_not_empty_interrupt_source(ata_dma_read_pio_sm), true);
+
+        pio_sm_put_blocking(ata_pio, ata_dma_read_pio_sm, register_address_bits(ATAReg::Status) << 27 | register_address_bits(ATAReg::Data) << 22 | (count - 1) << 6);
+    }
+
+    bool get_polled_status(uint8_t &status)
+    {
+        if(pio_sm_is_rx_fifo_empty(ata_pio, ata_dma_read_pio_sm))
+            return false;
+
+        status = pio_sm_get(ata_pio, ata_dma_read_pio_sm) >> 24;
+        return true;
+    }
+
+    // the SM is already reading, catch up
+    // it pushes two words at a time
+    void continue_polled_read(uint16_t *data, int count)
+    {
+        assert((count & 1) == 0);
+
+        auto config = dma_get_channel_config(ata_read_dma_chan);
+        channel_config_set_dreq(&config, pio_get_dreq(ata_pio, ata_dma_read_pio_sm, false));
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+        channel_config_set_sniff_enable(&config, false);
+        dma_channel_configure(ata_read_dma_chan, &config, data, &ata_pio->rxf[ata_dma_read_pio_sm], count / 2, true);
+
+        active_dma_chan = ata_read_dma_chan;
+        active_sm = ata_dma_read_pio_sm;
+    }
+
+    void reset_status_poll()
+    {
+        pio_sm_set_enabled(ata_pio, ata_dma_read_pio_sm, false);
+        pio_sm_clear_fifos(ata_pio, ata_dma_read_pio_sm);
+        pio_sm_restart(ata_pio, ata_dma_read_pio_sm);
+        pio_sm_exec(ata_pio, ata_dma_read_pio_sm, pio_encode_jmp(status_poll_program_offset) | pio_encode_sideset(1, 1));
+        pio_sm_set_enabled(ata_pio, ata_dma_read_pio_sm, true);
+    }
+
+    // the status poll SM raises an interrupt once it has the status
+    void wait_for_status_poll(absolute_time_t timeout_time)
+    {
+        if(pio_sm_is_rx_fifo_empty(ata_pio, ata_dma_read_pio_sm))
+            best_effort_wfe_or_timeout(timeout_time);
+    }
+
+    void set_transfer_mode(TransferMode mode, int mode_num)
+    {
+        // switching between devices in the same mode
+        if(mode == data_transfer_mode && mode_num == data_transfer_mode_num)
+            return;
+
+        if(mode == TransferMode::MultiwordDMA)
+            setup_multiword_dma(mode_num);
+        else if(mode == TransferMode::UltraDMA)
+            setup_ultra_dma(mode_num);
+        else
+        {
+            unload_dma_programs();
+            load_status_poll_program();
+        }
+
+        data_transfer_mode = mode;
+        data_transfer_mode_num = mode_num;
+    }
+
+    int get_max_ultra_dma_mode()
+    {
+        // reads sample the data up to one PIO clock before the strobe edge, which has to be within the setup time
+        double clock_ns = 1000000000.0 / clock_get_hz(clk_sys);
+
+        int mode = 5;
+        while(mode > 0 && clock_ns > udma_data_setup_time[mode])
+            mode--;
+
+        return mode;
+    }
+
+    // the device may split the transfer into multiple bursts
+    void start_dma_read(const RegisterWrite *taskfile, int taskfile_len, uint16_t *data, int count)
+    {
+        dma_write = false;
+        dma_read_data = data;
+        dma_words = count;
+        dma_words_done = 0;
+
+        if(data_transfer_mode == TransferMode::UltraDMA)
+        {
+            dma_sniffer_enable(ata_read_dma_chan, DMA_SNIFF_CTRL_CALC_VALUE_CRC16R, true);
+            dma_sniffer_set_data_accumulator(udma_crc_seed);
+
+            start_read_dma(ata_dma_read_pio_sm, data, count, true);
+
+            if(taskfile_len)
+                ata::bus::write_registers(taskfile, taskfile_len);
+            negate_cs();
+            return;
+        }
+
+        if(taskfile_len)
+            ata::bus::write_registers(taskfile, taskfile_len);
+        negate_cs();
+
+        start_mwdma_chunk();
+    }
+
+    void start_dma_write(const RegisterWrite *taskfile, int taskfile_len, const uint16_t *data, int count)
+    {
+        dma_write = true;
+        dma_write_data = data;
+        dma_words = count;
+        dma_words_done = 0;
+
+        if(taskfile_len)
+            ata::bus::write_registers(taskfile, taskfile_len);
+        negate_cs();
+
+        // after the command as the write SM also sets the direction
+        set_dma_data_output(true);
+
+        if(data_transfer_mode == TransferMode::UltraDMA)
+            start_udma_write_burst();
+        else
+            start_mwdma_chunk();
+    }
+
+    TransferStatus update_dma_transfer(absolute_time_t timeout_time)
+    {
+        if(data_transfer_mode == TransferMode::UltraDMA)
+            return dma_write ? update_udma_write() : update_udma_read(timeout_time);
+
+        return update_mwdma();
+    }
+
+    bool has_interrupt()
+    {
+#ifdef ATA_INTRQ_PIN
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void set_interrupts_enabled(bool enabled)
+    {
+#ifdef ATA_INTRQ_PIN
+        interrupts_enabled = enabled;
+        interrupt_pending = false;
+#endif
+    }
+
+    bool check_interrupt()
+    {
+#ifdef ATA_INTRQ_PIN
+        if(!interrupts_enabled)
+            return true;
+
+        // also check the level in case the edge was missed
+        if(!interrupt_pending && !gpio_get(ATA_INTRQ_PIN))
+            return false;
+
+        interrupt_pending = false;
+#endif
+        return true;
+    }
+
+    void clear_interrupt()
+    {
+#ifdef ATA_INTRQ_PIN
+        interrupt_pending = false;
+#endif
+    }
+
+    void wait_for_interrupt(absolute_time_t timeout_time)
+    {
+#ifdef ATA_INTRQ_PIN
+        if(!interrupts_enabled)
+            return;
+
+        // if the interrupt arrives after the check, the event is still set and this returns immediately
+        if(!interrupt_pending && !gpio_get(ATA_INTRQ_PIN))
+            best_effort_wfe_or_timeout(timeout_time);
+#endif
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+
+#include "pico/time.h"
+
+#include "ata.hpp"
+
+// low level bus access used by the command layer in ata.cpp
+// ata-bus-pio.cpp drives a real bus with PIO, host/ata-bus-sim.cpp talks to simulated devices
+namespace ata::bus
+{
+    enum class TransferStatus
+    {
+        Running,
+        Done,
+        Failed,
+    };
+
+    void init();
+
+    // pulses RESET-
+    void hardware_reset();
+
+    // timing for PIO data transfers and register access, see ata::adjust_for_min_cycle_time
+    // both devices see register accesses, so that timing has to suit the slowest one
+    void set_pio_timing(int min_cycle_time, int register_min_cycle_time);
+
+    uint16_t read_register(ATAReg reg);
+
+    // writing the Command register should be last
+    void write_registers(const RegisterWrite *writes, int count);
+
+    // PIO data transfers of one DRQ block, DRQ should be set
+    void start_pio_read(uint16_t *data, int count);
+    void start_pio_write(const uint16_t *data, int count);
+    bool is_transfer_done();
+
+    // returns false on timeout
+    bool finish_transfer(uint32_t timeout_ms);
+
+    // used if the device stops responding mid-transfer, does nothing if there's no transfer
+    void abort_transfer();
+
+    // PIO reads where the bus polls the status and starts the transfer as soon as DRQ is set
+    // not all buses can do this, the status register is polled instead
+    bool has_status_poll();
+    void start_status_poll(int count);
+
+    // returns true once the status has been read, the read has already started if DRQ is set
+    bool get_polled_status(uint8_t &status);
+    void continue_polled_read(uint16_t *data, int count);
+
+    // stops polling/reading and goes back to waiting for a request
+    void reset_status_poll();
+    void wait_for_status_poll(absolute_time_t timeout_time);
+
+    // switches the data transfer mode, PIO timing is set separately
+    void set_transfer_mode(TransferMode mode, int mode_num);
+    int get_max_ultra_dma_mode();
+
+    // DMA transfers, these write the taskfile (ending with the command) as the order matters
+    // (an empty taskfile continues a command that's already been written, for SERVICE)
+    void start_dma_read(const RegisterWrite *taskfile, int taskfile_len, uint16_t *data, int count);
+    void start_dma_write(const RegisterWrite *taskfile, int taskfile_len, const uint16_t *data, int count);
+
+    // returns Failed if the transfer couldn't be ended cleanly or by timeout_time
+    // (otherwise timeouts are up to the caller)
+    TransferStatus update_dma_transfer(absolute_time_t timeout_time);
+
+    // INTRQ, false if it isn't connected
+    bool has_interrupt();
+    void set_interrupts_enabled(bool enabled);
+
+    // returns true if the device has interrupted, or if interrupts aren't enabled
+    // the status register should be read after this to clear the interrupt
+    bool check_interrupt();
+    void clear_interrupt();
+
+    // sleeps until INTRQ (or any other event), returns immediately if interrupts aren't enabled or one is pending
+    void wait_for_interrupt(absolute_time_t timeout_time);
+}
@@ -1,117 +1,266 @@
-#include <cmath>
+#include <algorithm>
 
-#include "hardware/clocks.h"
-#include "hardware/gpio.h"
-#include "hardware/pio.h"
 #include "pico/time.h"
 
 #include "ata.hpp"
+#include "ata-bus.hpp"
+#include "identity.hpp"
 
 #include "config.h"
 
-#include "ata.pio.h"
+#if ATA_STATS && PICO_ON_DEVICE && !defined(__riscv)
+#include "hardware/structs/m33.h"
+#elif ATA_STATS && !PICO_ON_DEVICE
+#include <chrono>
+#endif
 
-static const PIO ata_pio = pio0;
-static int ata_read_pio_sm = -1, ata_write_pio_sm = -1;
-
-static int calculate_clkdiv(int target_cycle_time)
+// timing and transfer mode for each device, the bus is switched to these when the device is selected
+struct DeviceTiming
 {
-    double clock_ns = 1000000000.0 / clock_get_hz(clk_sys);
-    int target_ns = target_cycle_time / 6; // 6 instructions for the loop
-    int clkdiv = ceil(target_ns / clock_ns);
+    bool adjusted = false; // set up for this device, otherwise it doesn't limit the register timing
+    int min_cycle_time = 600;
+    ata::TransferMode mode = ata::TransferMode::PIO;
+    int mode_num = 0;
+};
 
-    return clkdiv;
-}
+static DeviceTiming device_timing[2];
 
-namespace ata
+// device the bus is set up for, -1 after a change
+static int bus_timing_device = -1;
+
+// sectors per DRQ block for READ/WRITE MULTIPLE, 0 if disabled
+static int multiple_sectors[2]{};
+
+// set from IDENTIFY DEVICE
+static bool address_48bit[2]{};
+
+// async sector commands
+enum class CommandState
 {
-    void init_io()
+    Free,
+    Queued,
+    WaitReady,
+    WaitRelease, // queued, the device either releases the bus or starts the data
+    Released, // queued, waiting for the device to ask for SERVICE
+    WaitDataRequest, // PIO, before each DRQ block
+    DataTransfer,
+    WaitComplete,
+    Done,
+    Failed,
+    Merged, // part of another command, finishes with it
+};
+
+struct Command
+{
+    CommandState state = CommandState::Free;
+    bool write;
+    int device;
+    uint64_t lba;
+    int num_sectors;
+    uint16_t *read_data;
+    const uint16_t *write_data;
+
+    uint32_t sequence; // submission order
+    int requested_sectors; // num_sectors also covers any merged commands while active
+    int merged_into;
+    int tag; // READ/WRITE DMA QUEUED
+
+    int sectors_done; // PIO, or the result once done
+    int block_sectors;
+    bool wait_interrupt; // PIO, there's no interrupt before the first block of a write
+    bool status_polling; // PIO read, waiting for the bus to poll the status
+
+    absolute_time_t timeout_time;
+
+    uint32_t phase_start_cycles; // ATA_STATS
+};
+
+// registers for a command, written in one burst
+struct Taskfile
+{
+    // enough for a 48-bit (queued) command
+    ata::RegisterWrite writes[12];
+    int len = 0;
+
+    void add(ata::ATAReg reg, uint16_t data)
     {
-        // setup all the IO
-        gpio_init_mask(ATA_IO_MASK);
+        assert(len < 12);
+        writes[len++] = {reg, data};
+    }
+
+    void write_command(ata::ATACommand command)
+    {
+        add(ata::ATAReg::Command, static_cast<int>(command));
+        ata::write_registers(writes, len);
+    }
+};
 
-        // init the active low control signals
-        auto mask = ATA_RESET_PIN_MASK | ATA_CS_PIN_MASK;
-        gpio_put_masked(mask, mask);
+static const int max_commands = 8;
+static Command commands[max_commands];
 
-        // also set address pins to output
-        mask |= ATA_ADDR_PIN_MASK;
-        gpio_set_dir_out_masked(mask);
+// the command on the bus, the rest wait until the scheduler picks them
+static int active_command = -1;
+static uint32_t next_sequence = 0;
 
-        // PIO init
-        int read_program_offset = pio_add_program(pio0, &pio_read_program);
-        int write_program_offset = pio_add_program(pio0, &pio_write_program);
-        ata_read_pio_sm = pio_claim_unused_sm(ata_pio, true);
-        ata_write_pio_sm = pio_claim_unused_sm(ata_pio, true);
+// end of the last command on each device, the scheduler sweeps up from here
+static uint64_t head_lba[2]{};
 
-        // setup read/write pins
-        uint32_t rw_mask = ATA_READ_PIN_MASK | ATA_WRITE_PIN_MASK;
-        pio_sm_set_pins_with_mask(ata_pio, ata_read_pio_sm, rw_mask, rw_mask);
-        pio_sm_set_pindirs_with_mask(ata_pio, ata_read_pio_sm, rw_mask, rw_mask);
-        pio_gpio_init(ata_pio, ATA_READ_PIN);
-        pio_gpio_init(ata_pio, ATA_WRITE_PIN);
+// READ/WRITE DMA QUEUED, 0 if disabled
+static int queue_depth[2]{};
+static bool service_interrupt[2]{};
 
-        // setup data bus
-        pio_sm_set_pindirs_with_mask(ata_pio, ata_read_pio_sm, 0, ATA_DATA_PIN_MASK);
-        for(int i = 0; i < 16; i++)
-            pio_gpio_init(ata_pio, ATA_DATA_PIN_BASE + i);
+// queued commands the device has released the bus for
+static int released_commands[2]{};
+static absolute_time_t service_timeout_time[2];
 
-        // configure read program
-        pio_sm_config c = pio_read_program_get_default_config(read_program_offset);
+// how long a device can keep queued commands without asking for SERVICE
+static const uint32_t service_timeout_ms = 5000;
 
-        sm_config_set_in_shift(&c, false, true, 16); // data
-        sm_config_set_out_shift(&c, false, true, 16); // read count
+static unsigned int udma_crc_errors = 0;
 
-        sm_config_set_in_pins(&c, ATA_DATA_PIN_BASE);
-        sm_config_set_sideset_pins(&c, ATA_READ_PIN);
-        sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+#if ATA_STATS
+static ata::CommandStats command_stats[static_cast<int>(ata::StatsCommandType::Count)];
 
-        // calc clkdiv
-        int clkdiv = calculate_clkdiv(600); // PIO mode 0 cycle time
-        sm_config_set_clkdiv_int_frac8(&c, clkdiv, 0);
+// polls/errors outside of the command engine count as other commands
+static ata::StatsCommandType stats_active_type = ata::StatsCommandType::Other;
 
-        pio_sm_init(ata_pio, ata_read_pio_sm, read_program_offset, &c);
+// the counter is per-core, so this is called from wherever commands are run
+// (the host build counts nanoseconds instead)
+static void enable_cycle_count()
+{
+#if !PICO_ON_DEVICE
+#elif defined(__riscv)
+    asm volatile("csrci mcountinhibit, 1");
+#else
+    if(!(m33_hw->dwt_ctrl & M33_DWT_CTRL_CYCCNTENA_BITS))
+    {
+        m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+        m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+    }
+#endif
+}
 
-        // configure write program
-        c = pio_write_program_get_default_config(write_program_offset);
+static uint32_t read_cycle_count()
+{
+#if !PICO_ON_DEVICE
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#elif defined(__riscv)
+    uint32_t cycles;
+    asm volatile("csrr %0, mcycle" : "=r"(cycles));
+    return cycles;
+#else
+    return m33_hw->dwt_cyccnt;
+#endif
+}
+#endif
 
-        sm_config_set_out_shift(&c, false, false, 16); // data
+static void stats_set_active([[maybe_unused]] const Command *cmd)
+{
+#if ATA_STATS
+    stats_active_type = !cmd ? ata::StatsCommandType::Other : (cmd->write ? ata::StatsCommandType::Write : ata::StatsCommandType::Read);
+#endif
+}
 
-        sm_config_set_out_pins(&c, ATA_DATA_PIN_BASE, 16);
-        sm_config_set_sideset_pins(&c, ATA_WRITE_PIN);
-        sm_config_set_jmp_pin(&c, ATA_IORDY_PIN);
+static void stats_begin_command([[maybe_unused]] Command &cmd)
+{
+#if ATA_STATS
+    enable_cycle_count();
+    command_stats[static_cast<int>(stats_active_type)].commands++;
+    cmd.phase_start_cycles = read_cycle_count();
+#endif
+}
 
-        sm_config_set_clkdiv_int_frac8(&c, clkdiv, 0);
+static void stats_end_phase([[maybe_unused]] Command &cmd, [[maybe_unused]] ata::StatsPhase phase)
+{
+#if ATA_STATS
+    auto now = read_cycle_count();
+    uint32_t cycles = now - cmd.phase_start_cycles;
+    cmd.phase_start_cycles = now;
+
+    auto &stats = command_stats[static_cast<int>(stats_active_type)];
+    stats.phase_cycles[static_cast<int>(phase)] += cycles;
+    stats.phase_max_cycles[static_cast<int>(phase)] = std::max(stats.phase_max_cycles[static_cast<int>(phase)], cycles);
+#endif
+}
 
-        pio_sm_init(ata_pio, ata_write_pio_sm, write_program_offset, &c);
+static void stats_count_status_poll()
+{
+#if ATA_STATS
+    command_stats[static_cast<int>(stats_active_type)].status_polls++;
+#endif
+}
 
-        // start
-        pio_set_sm_mask_enabled(ata_pio, 1 << ata_read_pio_sm | 1 << ata_write_pio_sm, true);
+static void stats_count_failure([[maybe_unused]] bool timeout)
+{
+#if ATA_STATS
+    auto &stats = command_stats[static_cast<int>(stats_active_type)];
+    if(timeout)
+        stats.timeouts++;
+    else
+        stats.errors++;
+#endif
+}
+
+namespace ata
+{
+    void init_io()
+    {
+        bus::init();
     }
 
     void adjust_for_min_cycle_time(int min_cycle_time)
     {
-        // we're wrong for reg access in modes 1-2 (330-383ns cycle times)
-        // (and the mode 2 cycle time for reg access is different...)
-        // let's just hope nobody connects a drive that slow
-        int clkdiv = calculate_clkdiv(min_cycle_time);
+        for(auto &timing : device_timing)
+        {
+            timing.adjusted = false;
+            timing.min_cycle_time = min_cycle_time;
+        }
 
-        pio_set_sm_mask_enabled(ata_pio, 1 << ata_read_pio_sm | 1 << ata_write_pio_sm, false);
+        bus_timing_device = -1;
+        bus::set_pio_timing(min_cycle_time, min_cycle_time);
+    }
 
-        pio_sm_set_clkdiv_int_frac8(ata_pio, ata_read_pio_sm, clkdiv, 0);
-        pio_sm_set_clkdiv_int_frac8(ata_pio, ata_write_pio_sm, clkdiv, 0);
+    void adjust_for_min_cycle_time(int device, int min_cycle_time)
+    {
+        assert(device < 2);
+
+        device_timing[device].adjusted = true;
+        device_timing[device].min_cycle_time = min_cycle_time;
 
-        pio_set_sm_mask_enabled(ata_pio, 1 << ata_read_pio_sm | 1 << ata_write_pio_sm, true);
+        bus_timing_device = -1;
+    }
+
+    // the bus arbiter, everything on the cable goes through here before talking to a device
+    void select_device(int device)
+    {
+        assert(device < 2);
+
+        if(device != bus_timing_device)
+        {
+            auto &timing = device_timing[device];
+
+            // register access is seen by both devices
+            int register_cycle_time = timing.min_cycle_time;
+            for(auto &other : device_timing)
+            {
+                if(other.adjusted)
+                    register_cycle_time = std::max(register_cycle_time, other.min_cycle_time);
+            }
+
+            bus::set_pio_timing(timing.min_cycle_time, register_cycle_time);
+            bus::set_transfer_mode(timing.mode, timing.mode_num);
+
+            bus_timing_device = device;
+        }
+
+        write_register(ATAReg::Device, device << 4 /*device id*/);
     }
 
     void do_reset()
     {
-        // assert reset
-        gpio_put(ATA_RESET_PIN, false);
-        sleep_us(25);
+        bus::hardware_reset();
 
         // now wait a bit
-        gpio_put(ATA_RESET_PIN, true);
         sleep_ms(2);
 
         // wait for reset
@@ -128,36 +277,21 @@ namespace ata
 
     uint16_t read_register(ATAReg reg)
     {
-        // set address
-        gpio_put_masked(ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK, static_cast<int>(reg) >> 3 << ATA_CS_PIN_BASE | (static_cast<int>(reg) & 7) << ATA_ADDR_PIN_BASE);
-
-        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + ata_read_pio_sm);
-
-        // count = 1
-        pio_sm_put_blocking(ata_pio, ata_read_pio_sm, 0);
-        ata_pio->fdebug |= stall_mask;
+        if(reg == ATAReg::Status || reg == ATAReg::AltStatus)
+            stats_count_status_poll();
 
-        // get result
-        uint16_t data = pio_sm_get_blocking(ata_pio, ata_read_pio_sm);
-
-        // wait for stall
-        while(!(ata_pio->fdebug & stall_mask));
-
-        return data;
+        return bus::read_register(reg);
     }
 
     void write_register(ATAReg reg, uint16_t data)
     {
-        // set address
-        gpio_put_masked(ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK, static_cast<int>(reg) >> 3 << ATA_CS_PIN_BASE | (static_cast<int>(reg) & 7) << ATA_ADDR_PIN_BASE);
-
-        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + ata_write_pio_sm);
-
-        pio_sm_put_blocking(ata_pio, ata_write_pio_sm, data << 16);
+        RegisterWrite write{reg, data};
+        write_registers(&write, 1);
+    }
 
-        // wait for stall
-        ata_pio->fdebug |= stall_mask;
-        while(!(ata_pio->fdebug & stall_mask));
+    void write_registers(const RegisterWrite *writes, int count)
+    {
+        bus::write_registers(writes, count);
     }
 
     bool check_ready()
@@ -175,7 +309,10 @@ namespace ata
         {
             // fail if reached timeout
             if(time_reached(timeout_time))
+            {
+                stats_count_failure(true);
                 return false;
+            }
         }
 
         return true;
@@ -199,11 +336,17 @@ namespace ata
 
             // fail if error
             if(status & Status_ERR)
+            {
+                stats_count_failure(false);
                 return false;
+            }
 
             // fail if reached timeout
             if(time_reached(timeout_time))
+            {
+                stats_count_failure(true);
                 return false;
+            }
         }
     }
 
@@ -223,56 +366,95 @@ namespace ata
 
     bool do_pio_read(uint16_t *data, int count, uint32_t timeout_ms)
     {
-        if(!wait_data_request(timeout_ms))
+        if(!start_pio_read(data, count, timeout_ms))
             return false;
 
-        assert(count > 0);
-        assert(count <= 0x10000);
+        finish_pio_transfer();
 
-        // set address
-        auto reg = ATAReg::Data;
-        gpio_put_masked(ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK, static_cast<int>(reg) >> 3 << ATA_CS_PIN_BASE | (static_cast<int>(reg) & 7) << ATA_ADDR_PIN_BASE);
+        return true;
+    }
 
-        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + ata_read_pio_sm);
+    bool do_pio_write(const uint16_t *data, int count, uint32_t timeout_ms)
+    {
+        if(!start_pio_write(data, count, timeout_ms))
+            return false;
+
+        finish_pio_transfer();
 
-        pio_sm_put_blocking(ata_pio, ata_read_pio_sm, (count - 1) << 16);
-        ata_pio->fdebug |= stall_mask;
+        return true;
+    }
 
-        // TODO: DMA?
-        for(int i = 0; i < count; i++)
-            data[i] = pio_sm_get_blocking(ata_pio, ata_read_pio_sm);
+    bool start_pio_read(uint16_t *data, int count, uint32_t timeout_ms)
+    {
+        if(!wait_data_request(timeout_ms))
+            return false;
 
-        // wait for stall
-        while(!(ata_pio->fdebug & stall_mask));
+        bus::start_pio_read(data, count);
 
         return true;
     }
 
-    bool do_pio_write(const uint16_t *data, int count, uint32_t timeout_ms)
+    bool start_pio_write(const uint16_t *data, int count, uint32_t timeout_ms)
     {
         if(!wait_data_request(timeout_ms))
             return false;
 
-        // set address
-        auto reg = ATAReg::Data;
-        gpio_put_masked(ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK, static_cast<int>(reg) >> 3 << ATA_CS_PIN_BASE | (static_cast<int>(reg) & 7) << ATA_ADDR_PIN_BASE);
+        bus::start_pio_write(data, count);
+
+        return true;
+    }
 
-        uint32_t stall_mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + ata_write_pio_sm);
+    bool is_pio_transfer_done()
+    {
+        return bus::is_transfer_done();
+    }
 
-        // TODO: DMA?
-        for(int i = 0; i < count; i++)
-            pio_sm_put_blocking(ata_pio, ata_write_pio_sm, data[i] << 16);
+    void finish_pio_transfer()
+    {
+        bus::finish_transfer(~0u);
+    }
 
-        // wait for stall
-        ata_pio->fdebug |= stall_mask;
-        while(!(ata_pio->fdebug & stall_mask));
+    static bool update_dma_transfer(Command &cmd)
+    {
+        auto status = bus::update_dma_transfer(cmd.timeout_time);
 
-        return true;
+        if(status == bus::TransferStatus::Done)
+        {
+            cmd.state = CommandState::WaitComplete;
+            return true;
+        }
+
+        return status == bus::TransferStatus::Running && !time_reached(cmd.timeout_time);
+    }
+
+    // checks for a UDMA CRC error after a failed command, drops to a slower mode if there was one
+    static void check_udma_crc_error(int device)
+    {
+        if(!(read_register(ATAReg::Error) & Error_ICRC))
+            return;
+
+        udma_crc_errors++;
+
+        int mode_num = device_timing[device].mode_num;
+        if(mode_num > 0)
+            set_transfer_mode(device, TransferMode::UltraDMA, mode_num - 1);
+    }
+
+    // drops to a slower UDMA mode if clk_sys has gone down too far to sample the current one
+    // (not while the device has queued commands, SET FEATURES would abort them)
+    static void check_udma_max_mode(int device)
+    {
+        if(device_timing[device].mode != TransferMode::UltraDMA || released_commands[device])
+            return;
+
+        int max_mode_num = bus::get_max_ultra_dma_mode();
+        if(device_timing[device].mode_num > max_mode_num)
+            set_transfer_mode(device, TransferMode::UltraDMA, max_mode_num);
     }
 
     bool device_reset(int device)
     {
-        write_register(ATAReg::Device, device << 4 /*device id*/);
+        select_device(device);
         write_command(ATACommand::DEVICE_RESET);
 
         sleep_us(1);
@@ -280,69 +462,752 @@ namespace ata
         return wait_not_busy_check_error();
     }
 
-    int read_sectors(int device, uint32_t lba, int num_sectors, uint16_t *data)
+    // writes the address and count, returns true if the EXT commands are needed
+    // queued commands have the count in the features register and the tag in the sector count
+    static bool setup_sector_taskfile(Taskfile &taskfile, int device, uint64_t lba, int num_sectors, int tag = -1)
     {
-        // TODO: timeout?
+        bool ext = lba + num_sectors > 0x10000000 || num_sectors > 256;
+        auto count_reg = tag == -1 ? ATAReg::SectorCount : ATAReg::Features;
 
-        assert(device < 2);
-        assert(num_sectors <= 256);
-        assert(lba < 0x10000000); // TODO: LBA48
+        if(ext)
+        {
+            assert(address_48bit[device]);
+            assert(num_sectors <= 65536);
+            assert(lba + num_sectors <= 1ull << 48);
+
+            // high bytes first, the registers keep the previous value for the EXT commands
+            taskfile.add(count_reg, (num_sectors >> 8) & 0xFF);
+            if(tag != -1)
+                taskfile.add(ATAReg::SectorCount, 0);
+            taskfile.add(ATAReg::LBALow, (lba >> 24) & 0xFF);
+            taskfile.add(ATAReg::LBAMid, (lba >> 32) & 0xFF);
+            taskfile.add(ATAReg::LBAHigh, (lba >> 40) & 0xFF);
+        }
 
-        write_register(ATAReg::Device, device << 4);
+        taskfile.add(count_reg, num_sectors & 0xFF); // 0 == 256 (or 65536), so just throw away the high bit
+        if(tag != -1)
+            taskfile.add(ATAReg::SectorCount, tag << 3);
+        taskfile.add(ATAReg::LBALow, lba & 0xFF);
+        taskfile.add(ATAReg::LBAMid, (lba >> 8) & 0xFF);
+        taskfile.add(ATAReg::LBAHigh, (lba >> 16) & 0xFF);
 
-        if(!wait_ready())
-            return 0;
+        if(ext)
+            taskfile.add(ATAReg::Device, 1 << 6 /*LBA*/ | device << 4 /*device id*/);
+        else
+            taskfile.add(ATAReg::Device, 1 << 6 /*LBA*/ | device << 4 /*device id*/ | ((lba >> 24) & 0xF));
+
+        return ext;
+    }
+
+    static bool uses_queued_commands(int device)
+    {
+        return queue_depth[device] && device_timing[device].mode != TransferMode::PIO;
+    }
+
+    // issued to the device and not finished
+    static bool is_outstanding(const Command &cmd)
+    {
+        return cmd.state != CommandState::Free && cmd.state != CommandState::Queued && cmd.state != CommandState::Merged
+            && cmd.state != CommandState::Done && cmd.state != CommandState::Failed;
+    }
+
+    static int allocate_tag(int device)
+    {
+        uint32_t used = 0;
+
+        for(auto &cmd : commands)
+        {
+            if(cmd.device == device && cmd.tag != -1 && is_outstanding(cmd))
+                used |= 1u << cmd.tag;
+        }
+
+        int tag = 0;
+        while(used & (1u << tag))
+            tag++;
+
+        return tag;
+    }
 
-        write_register(ATAReg::SectorCount, num_sectors & 0xFF); // 0 == 256, so just throw away the high bit
-        write_register(ATAReg::LBALow, lba & 0xFF);
-        write_register(ATAReg::LBAMid, (lba >> 8) & 0xFF);
-        write_register(ATAReg::LBAHigh, (lba >> 16) & 0xFF);
-        write_register(ATAReg::Device, 1 << 6 /*LBA*/ | device << 4 /*device id*/ | ((lba >> 24) & 0xF));
-        write_command(ATACommand::READ_SECTOR);
+    // the DMA for a queued command, the device has set DRQ
+    static void start_queued_data(Command &cmd)
+    {
+        if(cmd.write)
+            bus::start_dma_write(nullptr, 0, cmd.write_data, cmd.num_sectors * 256);
+        else
+            bus::start_dma_read(nullptr, 0, cmd.read_data, cmd.num_sectors * 256);
+
+        cmd.state = CommandState::DataTransfer;
+        cmd.timeout_time = make_timeout_time_ms(1000 * ((cmd.num_sectors + 255) / 256));
+    }
 
-        int sector;
-        for(sector = 0; sector < num_sectors; sector++)
+    // device is ready, setup the taskfile and start the command
+    static void start_sector_command(Command &cmd)
+    {
+        Taskfile taskfile;
+
+        bus::clear_interrupt();
+
+        if(uses_queued_commands(cmd.device))
         {
-            // 512 bytes per sector
-            if(!do_pio_read(data + sector * 256, 256))
-                break;
+            cmd.tag = allocate_tag(cmd.device);
+            bool ext = setup_sector_taskfile(taskfile, cmd.device, cmd.lba, cmd.num_sectors, cmd.tag);
+
+            if(cmd.write)
+                taskfile.write_command(ext ? ATACommand::WRITE_DMA_QUEUED_EXT : ATACommand::WRITE_DMA_QUEUED);
+            else
+                taskfile.write_command(ext ? ATACommand::READ_DMA_QUEUED_EXT : ATACommand::READ_DMA_QUEUED);
+
+            cmd.state = CommandState::WaitRelease;
+            cmd.timeout_time = make_timeout_time_ms(1000);
+            return;
+        }
+
+        bool ext = setup_sector_taskfile(taskfile, cmd.device, cmd.lba, cmd.num_sectors);
+
+        if(device_timing[cmd.device].mode == TransferMode::PIO)
+        {
+            cmd.block_sectors = multiple_sectors[cmd.device];
+
+            if(cmd.write && cmd.block_sectors)
+                taskfile.write_command(ext ? ATACommand::WRITE_MULTIPLE_EXT : ATACommand::WRITE_MULTIPLE);
+            else if(cmd.write)
+                taskfile.write_command(ext ? ATACommand::WRITE_SECTOR_EXT : ATACommand::WRITE_SECTOR);
+            else if(cmd.block_sectors)
+                taskfile.write_command(ext ? ATACommand::READ_MULTIPLE_EXT : ATACommand::READ_MULTIPLE);
+            else
+                taskfile.write_command(ext ? ATACommand::READ_SECTOR_EXT : ATACommand::READ_SECTOR);
+
+            if(!cmd.block_sectors)
+                cmd.block_sectors = 1;
+
+            cmd.wait_interrupt = !cmd.write;
+            cmd.state = CommandState::WaitDataRequest;
+            cmd.timeout_time = make_timeout_time_ms(1000);
+            return;
+        }
+
+        ATACommand command;
+        if(cmd.write)
+            command = ext ? ATACommand::WRITE_DMA_EXT : ATACommand::WRITE_DMA;
+        else
+            command = ext ? ATACommand::READ_DMA_EXT : ATACommand::READ_DMA;
+
+        taskfile.add(ATAReg::Command, static_cast<int>(command));
+
+        if(cmd.write)
+            bus::start_dma_write(taskfile.writes, taskfile.len, cmd.write_data, cmd.num_sectors * 256);
+        else
+            bus::start_dma_read(taskfile.writes, taskfile.len, cmd.read_data, cmd.num_sectors * 256);
+
+        // one second per 256 sectors
+        cmd.state = CommandState::DataTransfer;
+        cmd.timeout_time = make_timeout_time_ms(1000 * ((cmd.num_sectors + 255) / 256));
+    }
+
+    // PIO data phase, one DRQ block at a time
+    // hand a PIO read over to the bus, which starts the data transfer as soon as DRQ is set
+    static void start_status_poll(Command &cmd)
+    {
+        // the last block may be short
+        cmd.block_sectors = std::min(cmd.block_sectors, cmd.num_sectors - cmd.sectors_done);
+
+        bus::start_status_poll(cmd.block_sectors * 256);
+
+        cmd.status_polling = true;
+    }
+
+    static bool update_status_poll(Command &cmd)
+    {
+        uint8_t status;
+        if(!bus::get_polled_status(status))
+            return !time_reached(cmd.timeout_time);
+
+        cmd.status_polling = false;
+
+        // reading the status clears the interrupt
+        bus::clear_interrupt();
+
+        if(status & Status_DRQ)
+        {
+            bus::continue_polled_read(cmd.read_data + cmd.sectors_done * 256, cmd.block_sectors * 256);
+            cmd.state = CommandState::DataTransfer;
+            return true;
+        }
+
+        if(status & Status_ERR)
+            return false;
+
+        // neither, try again
+        return !time_reached(cmd.timeout_time);
+    }
+
+    static bool update_pio_data_request(Command &cmd)
+    {
+        if(!cmd.write && bus::has_status_poll())
+        {
+            if(!cmd.status_polling)
+                start_status_poll(cmd);
+
+            return update_status_poll(cmd);
+        }
+
+        if(cmd.wait_interrupt && !bus::check_interrupt())
+            return !time_reached(cmd.timeout_time);
+
+        auto status = read_register(ATAReg::Status);
+
+        if(!(status & Status_BSY))
+        {
+            if(status & Status_DRQ)
+            {
+                // the last block may be short
+                cmd.block_sectors = std::min(cmd.block_sectors, cmd.num_sectors - cmd.sectors_done);
+
+                // 512 bytes per sector
+                int offset = cmd.sectors_done * 256;
+                if(cmd.write)
+                    bus::start_pio_write(cmd.write_data + offset, cmd.block_sectors * 256);
+                else
+                    bus::start_pio_read(cmd.read_data + offset, cmd.block_sectors * 256);
+
+                cmd.state = CommandState::DataTransfer;
+                return true;
+            }
+
+            if(status & Status_ERR)
+                return false;
+        }
+
+        return !time_reached(cmd.timeout_time);
+    }
+
+    static bool update_pio_transfer(Command &cmd)
+    {
+        if(!is_pio_transfer_done())
+            return !time_reached(cmd.timeout_time);
+
+        finish_pio_transfer();
+
+        cmd.sectors_done += cmd.block_sectors;
+
+        // reads are complete once we have the data, writes need to wait for the device
+        if(cmd.sectors_done == cmd.num_sectors)
+            cmd.state = cmd.write ? CommandState::WaitComplete : CommandState::Done;
+        else
+        {
+            cmd.state = CommandState::WaitDataRequest;
+            cmd.wait_interrupt = true;
+        }
+
+        cmd.timeout_time = make_timeout_time_ms(1000);
+
+        return true;
+    }
+
+    static void fail_command(Command &cmd)
+    {
+        bus::abort_transfer();
+
+        if(cmd.status_polling)
+        {
+            bus::reset_status_poll();
+            cmd.status_polling = false;
         }
 
-        return sector;
+        cmd.state = CommandState::Failed;
+    }
+
+    static bool is_older(const Command &a, const Command &b)
+    {
+        return int32_t(a.sequence - b.sequence) < 0;
     }
 
-    int write_sectors(int device, uint32_t lba, int num_sectors, const uint16_t *data)
+    // a command can't pass an earlier one to the same sectors if either of them writes
+    // (including one the device has queued, it may reorder them)
+    static bool can_dispatch(const Command &cmd)
+    {
+        for(auto &other : commands)
+        {
+            bool pending = other.state != CommandState::Free && other.state != CommandState::Done && other.state != CommandState::Failed;
+
+            if(!pending || &other == &cmd || !is_older(other, cmd) || other.device != cmd.device)
+                continue;
+
+            bool overlaps = other.lba < cmd.lba + cmd.num_sectors && cmd.lba < other.lba + other.num_sectors;
+
+            if(overlaps && (other.write || cmd.write))
+                return false;
+        }
+
+        return true;
+    }
+
+    // C-LOOK, the lowest LBA at or above the head, or the lowest LBA if there's nothing above it
+    // (only on the device with the oldest command, so one device can't starve the other)
+    static int pick_next_command()
+    {
+        int oldest = -1;
+
+        for(int i = 0; i < max_commands; i++)
+        {
+            if(commands[i].state == CommandState::Queued && (oldest == -1 || is_older(commands[i], commands[oldest])))
+                oldest = i;
+        }
+
+        if(oldest == -1)
+            return -1;
+
+        int device = commands[oldest].device;
+
+        // while a device has queued commands outstanding only more queued commands for it can start
+        // (anything else would abort them)
+        if(released_commands[device ^ 1])
+            return -1;
+
+        if(released_commands[device] && (!uses_queued_commands(device) || released_commands[device] >= queue_depth[device]))
+            return -1;
+        int above = -1, lowest = -1;
+
+        for(int i = 0; i < max_commands; i++)
+        {
+            auto &cmd = commands[i];
+
+            if(cmd.state != CommandState::Queued || cmd.device != device || !can_dispatch(cmd))
+                continue;
+
+            if(cmd.lba >= head_lba[device] && (above == -1 || cmd.lba < commands[above].lba))
+                above = i;
+
+            if(lowest == -1 || cmd.lba < commands[lowest].lba)
+                lowest = i;
+        }
+
+        return above != -1 ? above : lowest;
+    }
+
+    // adds any queued commands that continue this one, both on the disk and in memory
+    static void merge_commands(int index)
+    {
+        auto &cmd = commands[index];
+        int max_sectors = address_48bit[cmd.device] ? 65536 : 256;
+
+        bool merged;
+        do
+        {
+            merged = false;
+
+            for(auto &next : commands)
+            {
+                if(next.state != CommandState::Queued || next.device != cmd.device || next.write != cmd.write)
+                    continue;
+
+                if(next.lba != cmd.lba + cmd.num_sectors || cmd.num_sectors + next.num_sectors > max_sectors)
+                    continue;
+
+                bool contiguous;
+                if(cmd.write)
+                    contiguous = next.write_data == cmd.write_data + cmd.num_sectors * 256;
+                else
+                    contiguous = next.read_data == cmd.read_data + cmd.num_sectors * 256;
+
+                if(!contiguous || !can_dispatch(next))
+                    continue;
+
+                next.state = CommandState::Merged;
+                next.merged_into = index;
+                cmd.num_sectors += next.num_sectors;
+                merged = true;
+            }
+        }
+        while(merged);
+    }
+
+    // splits the result of a finished command between the commands merged into it
+    static void finish_merged_commands(int index)
+    {
+        auto &cmd = commands[index];
+
+        for(auto &merged : commands)
+        {
+            if(merged.state != CommandState::Merged || merged.merged_into != index)
+                continue;
+
+            int offset = merged.lba - cmd.lba;
+            merged.sectors_done = std::clamp(cmd.sectors_done - offset, 0, merged.num_sectors);
+            merged.state = cmd.state;
+        }
+
+        cmd.num_sectors = cmd.requested_sectors;
+        cmd.sectors_done = std::min(cmd.sectors_done, cmd.num_sectors);
+    }
+
+    // NOP aborts anything the device has queued
+    // if another command failed these can be submitted again, as they didn't fail themselves
+    static void abort_released_commands(int device, bool retry)
+    {
+        select_device(device);
+
+        Taskfile taskfile;
+        taskfile.add(ATAReg::Features, 0);
+        taskfile.write_command(ATACommand::NOP);
+        wait_ready(100);
+
+        for(int i = 0; i < max_commands; i++)
+        {
+            auto &cmd = commands[i];
+
+            if(cmd.state != CommandState::Released || cmd.device != device)
+                continue;
+
+            if(retry)
+            {
+                // split up again, they'll be merged when picked
+                for(auto &merged : commands)
+                {
+                    if(merged.state == CommandState::Merged && merged.merged_into == i)
+                        merged.state = CommandState::Queued;
+                }
+
+                cmd.state = CommandState::Queued;
+                cmd.num_sectors = cmd.requested_sectors;
+                cmd.tag = -1;
+                continue;
+            }
+
+            cmd.state = CommandState::Failed;
+            cmd.sectors_done = 0;
+            finish_merged_commands(i);
+        }
+
+        released_commands[device] = 0;
+    }
+
+    // a device with released commands sets SERV when it's ready to transfer the data for one of them,
+    // returns the command SERVICE started the data for
+    static int service_released_command()
+    {
+        for(int device = 0; device < 2; device++)
+        {
+            if(!released_commands[device])
+                continue;
+
+            select_device(device);
+
+            if(!(read_register(ATAReg::Status) & Status_SERV))
+            {
+                if(time_reached(service_timeout_time[device]))
+                {
+                    stats_count_failure(true);
+                    abort_released_commands(device, false);
+                }
+                continue;
+            }
+
+            bus::clear_interrupt();
+            write_command(ATACommand::SERVICE);
+
+            // the tag is valid once the device is ready for the data
+            uint8_t status;
+            auto timeout_time = make_timeout_time_ms(100);
+            while(((status = read_register(ATAReg::Status)) & Status_BSY) && !time_reached(timeout_time));
+
+            int tag = read_register(ATAReg::SectorCount) >> 3;
+            int index = -1;
+
+            for(int i = 0; i < max_commands; i++)
+            {
+                if(commands[i].state == CommandState::Released && commands[i].device == device && commands[i].tag == tag)
+                    index = i;
+            }
+
+            if((status & (Status_BSY | Status_ERR)) || !(status & Status_DRQ) || index == -1)
+            {
+                stats_count_failure(status & Status_BSY);
+                abort_released_commands(device, false);
+                continue;
+            }
+
+            released_commands[device]--;
+            service_timeout_time[device] = make_timeout_time_ms(service_timeout_ms);
+
+            start_queued_data(commands[index]);
+
+            return index;
+        }
+
+        return -1;
+    }
+
+    static CommandHandle submit_sector_command(int device, uint64_t lba, int num_sectors, uint16_t *read_data, const uint16_t *write_data)
     {
         assert(device < 2);
-        assert(num_sectors <= 256);
-        assert(lba < 0x10000000); // TODO: LBA48
+        assert(num_sectors > 0);
+
+        int index = 0;
+        while(index < max_commands && commands[index].state != CommandState::Free)
+            index++;
+
+        if(index == max_commands)
+            return -1;
+
+        auto &cmd = commands[index];
+        cmd.state = CommandState::Queued;
+        cmd.write = write_data != nullptr;
+        cmd.device = device;
+        cmd.lba = lba;
+        cmd.num_sectors = num_sectors;
+        cmd.read_data = read_data;
+        cmd.write_data = write_data;
+        cmd.sequence = next_sequence++;
+        cmd.requested_sectors = num_sectors;
+        cmd.merged_into = -1;
+        cmd.tag = -1;
+        cmd.sectors_done = 0;
+        cmd.status_polling = false;
+
+        return index;
+    }
 
-        write_register(ATAReg::Device, device << 4);
+    CommandHandle submit_read_sectors(int device, uint64_t lba, int num_sectors, uint16_t *data)
+    {
+        return submit_sector_command(device, lba, num_sectors, data, nullptr);
+    }
 
-        if(!wait_ready())
-            return 0;
+    CommandHandle submit_write_sectors(int device, uint64_t lba, int num_sectors, const uint16_t *data)
+    {
+        return submit_sector_command(device, lba, num_sectors, nullptr, data);
+    }
+
+    void update_commands()
+    {
+        bool serviced = false;
+
+        if(active_command == -1)
+        {
+            // finish what the device has queued first
+            active_command = service_released_command();
+            serviced = active_command != -1;
+
+            if(!serviced)
+                active_command = pick_next_command();
+
+            if(active_command == -1)
+                return;
+
+            if(!serviced)
+                merge_commands(active_command);
+        }
+
+        auto &cmd = commands[active_command];
+
+        stats_set_active(&cmd);
 
-        write_register(ATAReg::SectorCount, num_sectors & 0xFF); // 0 == 256, so just throw away the high bit
-        write_register(ATAReg::LBALow, lba & 0xFF);
-        write_register(ATAReg::LBAMid, (lba >> 8) & 0xFF);
-        write_register(ATAReg::LBAHigh, (lba >> 16) & 0xFF);
-        write_register(ATAReg::Device, 1 << 6 /*LBA*/ | device << 4 /*device id*/ | ((lba >> 24) & 0xF));
-        write_command(ATACommand::WRITE_SECTOR);
+        // the device had it since it released the bus
+        if(serviced)
+            stats_end_phase(cmd, StatsPhase::BusyWait);
 
-        int sector;
-        for(sector = 0; sector < num_sectors; sector++)
+        bool ok = true;
+        auto prev_state = cmd.state;
+
+        switch(cmd.state)
         {
-            // 512 bytes per sector
-            if(!do_pio_write(data + sector * 256, 256))
+            case CommandState::Queued:
+                stats_begin_command(cmd);
+                check_udma_max_mode(cmd.device);
+                select_device(cmd.device);
+                cmd.state = CommandState::WaitReady;
+                cmd.timeout_time = make_timeout_time_ms(1000);
+                break;
+
+            case CommandState::WaitReady:
+                if(check_ready())
+                {
+                    stats_end_phase(cmd, StatsPhase::BusyWait);
+                    start_sector_command(cmd);
+                    stats_end_phase(cmd, StatsPhase::Taskfile);
+                }
+                else
+                    ok = !time_reached(cmd.timeout_time);
+                break;
+
+            case CommandState::WaitRelease:
+            {
+                // there's no interrupt if the device starts the data straight away, so this polls
+                auto status = read_register(ATAReg::Status);
+
+                if(status & Status_BSY)
+                    ok = !time_reached(cmd.timeout_time);
+                else if(status & Status_ERR)
+                    ok = false;
+                else if(status & Status_DRQ)
+                    start_queued_data(cmd);
+                else
+                {
+                    cmd.state = CommandState::Released;
+
+                    if(!released_commands[cmd.device]++)
+                        service_timeout_time[cmd.device] = make_timeout_time_ms(service_timeout_ms);
+                }
+                break;
+            }
+
+            case CommandState::WaitDataRequest:
+                ok = update_pio_data_request(cmd);
+                break;
+
+            case CommandState::DataTransfer:
+                if(device_timing[cmd.device].mode == TransferMode::PIO)
+                    ok = update_pio_transfer(cmd);
+                else
+                    ok = update_dma_transfer(cmd);
+
+                if(ok && cmd.state == CommandState::WaitComplete)
+                    cmd.timeout_time = make_timeout_time_ms(1000);
+                break;
+
+            case CommandState::WaitComplete:
+            {
+                if(!bus::check_interrupt())
+                {
+                    ok = !time_reached(cmd.timeout_time);
+                    break;
+                }
+
+                auto status = read_register(ATAReg::Status);
+
+                if(status & Status_BSY)
+                    ok = !time_reached(cmd.timeout_time);
+                else if(status & Status_ERR)
+                {
+                    if(device_timing[cmd.device].mode == TransferMode::UltraDMA)
+                        check_udma_crc_error(cmd.device);
+
+                    ok = false;
+                }
+                else
+                {
+                    cmd.sectors_done = cmd.num_sectors;
+                    cmd.state = CommandState::Done;
+                }
+                break;
+            }
+
+            default:
                 break;
         }
 
-        return sector;
+        if(cmd.state != prev_state)
+        {
+            if(prev_state == CommandState::WaitDataRequest)
+                stats_end_phase(cmd, StatsPhase::DataRequestWait);
+            else if(prev_state == CommandState::DataTransfer)
+                stats_end_phase(cmd, StatsPhase::DataTransfer);
+            else if(prev_state == CommandState::WaitComplete)
+                stats_end_phase(cmd, StatsPhase::Completion);
+            else if(prev_state == CommandState::WaitRelease)
+                stats_end_phase(cmd, StatsPhase::BusyWait);
+        }
+
+        if(!ok)
+        {
+            stats_count_failure(time_reached(cmd.timeout_time));
+
+            fail_command(cmd);
+
+            // DMA is all or nothing
+            if(device_timing[cmd.device].mode != TransferMode::PIO)
+                cmd.sectors_done = 0;
+
+            // an error also aborts everything else queued
+            if(cmd.tag != -1 && released_commands[cmd.device])
+                abort_released_commands(cmd.device, true);
+        }
+
+        if(cmd.state == CommandState::Done || cmd.state == CommandState::Failed)
+        {
+            head_lba[cmd.device] = cmd.lba + cmd.num_sectors;
+            finish_merged_commands(active_command);
+            active_command = -1;
+        }
+        else if(cmd.state == CommandState::Released)
+        {
+            // the bus is free for the next one
+            head_lba[cmd.device] = cmd.lba + cmd.num_sectors;
+            active_command = -1;
+        }
+
+        stats_set_active(nullptr);
+    }
+
+    void wait_for_interrupt()
+    {
+        if(active_command == -1)
+        {
+            // nothing to do until a device asks for SERVICE
+            for(int device = 0; device < 2; device++)
+            {
+                if(released_commands[device] && service_interrupt[device] && bus_timing_device == device)
+                    bus::wait_for_interrupt(service_timeout_time[device]);
+            }
+
+            return;
+        }
+
+        auto &cmd = commands[active_command];
+
+        if(cmd.state == CommandState::WaitDataRequest && cmd.status_polling)
+        {
+            bus::wait_for_status_poll(cmd.timeout_time);
+            return;
+        }
+
+        bool waiting = (cmd.state == CommandState::WaitDataRequest && cmd.wait_interrupt) || cmd.state == CommandState::WaitComplete;
+
+        if(waiting)
+            bus::wait_for_interrupt(cmd.timeout_time);
+    }
+
+    bool is_command_done(CommandHandle handle)
+    {
+        auto state = commands[handle].state;
+        return state == CommandState::Done || state == CommandState::Failed;
+    }
+
+    int complete_command(CommandHandle handle)
+    {
+        assert(commands[handle].state != CommandState::Free);
+
+        while(!is_command_done(handle))
+            update_commands();
+
+        commands[handle].state = CommandState::Free;
+
+        return commands[handle].sectors_done;
+    }
+
+    int read_sectors(int device, uint64_t lba, int num_sectors, uint16_t *data)
+    {
+        auto handle = submit_read_sectors(device, lba, num_sectors, data);
+
+        if(handle == -1)
+            return 0;
+
+        return complete_command(handle);
+    }
+
+    int write_sectors(int device, uint64_t lba, int num_sectors, const uint16_t *data)
+    {
+        auto handle = submit_write_sectors(device, lba, num_sectors, data);
+
+        if(handle == -1)
+            return 0;
+
+        return complete_command(handle);
     }
 
     bool identify_device(int device, uint16_t data[256], ATACommand command)
     {
-        write_register(ATAReg::Device, device << 4);
+        select_device(device);
 
         // wait for ready for non-PACKET command
         if(command != ATACommand::IDENTIFY_PACKET_DEVICE && !wait_ready())
@@ -350,22 +1215,207 @@ namespace ata
 
         write_command(command);
 
-        return do_pio_read(data, 256);
+        if(!do_pio_read(data, 256))
+            return false;
+
+        if(command == ATACommand::IDENTIFY_DEVICE && device < 2)
+            address_48bit[device] = IdentityParser(data).address_48bit_supported();
+
+        return true;
     }
 
     // sector count meaning depends on the feature
     bool set_features(int device, ATAFeature feature, uint8_t sectorCount)
     {
-        write_register(ATAReg::Device, device << 4);
+        select_device(device);
 
         if(!wait_ready())
             return false;
 
-        write_register(ATAReg::Features, static_cast<uint16_t>(feature));
-        write_register(ATAReg::SectorCount, sectorCount);
+        Taskfile taskfile;
+        taskfile.add(ATAReg::Features, static_cast<uint16_t>(feature));
+        taskfile.add(ATAReg::SectorCount, sectorCount);
 
-        write_command(ATACommand::SET_FEATURES);
+        taskfile.write_command(ATACommand::SET_FEATURES);
 
         return wait_not_busy_check_error();
     }
+
+    bool set_interrupts_enabled(bool enabled)
+    {
+        if(!bus::has_interrupt())
+            return !enabled;
+
+        // this is seen by both devices
+        write_register(ATAReg::DeviceControl, enabled ? 0 : DeviceControl_nIEN);
+
+        bus::set_interrupts_enabled(enabled);
+
+        return true;
+    }
+
+    bool test_interrupt(int device)
+    {
+        select_device(device);
+
+        if(!wait_ready(100))
+            return false;
+
+        bus::clear_interrupt();
+
+        // always aborted, with an interrupt
+        Taskfile taskfile;
+        taskfile.add(ATAReg::Features, 0);
+        taskfile.write_command(ATACommand::NOP);
+
+        // the alternate status doesn't clear the interrupt
+        auto timeout_time = make_timeout_time_ms(100);
+        bool interrupted = false;
+
+        while(!interrupted && !time_reached(timeout_time))
+            interrupted = !(read_register(ATAReg::AltStatus) & Status_BSY) && bus::check_interrupt();
+
+        read_register(ATAReg::Status);
+
+        return interrupted;
+    }
+
+    bool flush_cache(int device)
+    {
+        select_device(device);
+
+        if(!wait_ready())
+            return false;
+
+        // EXT is mandatory with 48-bit addressing
+        write_command(address_48bit[device] ? ATACommand::FLUSH_CACHE_EXT : ATACommand::FLUSH_CACHE);
+
+        // this can take a while if there's a lot in the cache
+        if(wait_not_busy_check_error())
+            return true;
+
+        // older devices may not support it, but then they don't have a cache to flush either
+        return read_register(ATAReg::Error) & Error_ABRT;
+    }
+
+    bool set_queue_depth(int device, int depth)
+    {
+        assert(device < 2);
+
+        depth = std::min(depth, max_commands);
+
+        // SERV is polled if this isn't supported
+        if(depth && !service_interrupt[device])
+            service_interrupt[device] = set_features(device, ATAFeature::EnableServiceInterrupt);
+        else if(!depth && service_interrupt[device])
+        {
+            set_features(device, ATAFeature::DisableServiceInterrupt);
+            service_interrupt[device] = false;
+        }
+
+        queue_depth[device] = depth;
+
+        return true;
+    }
+
+    int get_queue_depth(int device)
+    {
+        return queue_depth[device];
+    }
+
+    bool set_multiple_mode(int device, int sectors)
+    {
+        assert(device < 2);
+        assert(sectors <= 255);
+
+        select_device(device);
+
+        if(!wait_ready())
+            return false;
+
+        write_register(ATAReg::SectorCount, sectors);
+
+        write_command(ATACommand::SET_MULTIPLE_MODE);
+
+        if(!wait_not_busy_check_error())
+            return false;
+
+        multiple_sectors[device] = sectors;
+
+        return true;
+    }
+
+    int get_multiple_mode(int device)
+    {
+        return multiple_sectors[device];
+    }
+
+    bool set_transfer_mode(int device, TransferMode mode, int mode_num)
+    {
+        int mode_bits = 0;
+
+        switch(mode)
+        {
+            case TransferMode::PIO:
+                mode_bits = 1 << 3; // flow control mode
+                break;
+            case TransferMode::MultiwordDMA:
+                assert(mode_num <= 2);
+                mode_bits = 1 << 5;
+                break;
+            case TransferMode::UltraDMA:
+                assert(mode_num <= 5);
+                mode_bits = 1 << 6;
+                break;
+        }
+
+        if(!set_features(device, ATAFeature::SetTransferMode, mode_bits | mode_num))
+            return false;
+
+        device_timing[device].mode = mode;
+        device_timing[device].mode_num = mode_num;
+
+        // applied the next time the device is selected
+        bus_timing_device = -1;
+
+        return true;
+    }
+
+    TransferMode get_transfer_mode(int device)
+    {
+        return device_timing[device].mode;
+    }
+
+    int get_transfer_mode_num(int device)
+    {
+        return device_timing[device].mode_num;
+    }
+
+    int get_max_ultra_dma_mode()
+    {
+        return bus::get_max_ultra_dma_mode();
+    }
+
+    unsigned int get_udma_crc_error_count()
+    {
+        return udma_crc_errors;
+    }
+
+    bool get_stats([[maybe_unused]] StatsCommandType type, [[maybe_unused]] CommandStats &stats)
+    {
+#if ATA_STATS
+        stats = command_stats[static_cast<int>(type)];
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void reset_stats()
+    {
+#if ATA_STATS
+        for(auto &stats : command_stats)
+            stats = {};
+#endif
+    }
 }
\ No newline at end of file
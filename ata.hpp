@@ -6,35 +6,68 @@ namespace ata
     // includes CS and addr
     enum class ATAReg
     {
-        AltStatus   = 1 << 3 | 6,
-        Data        = 2 << 3 | 0,
-        Error       = 2 << 3 | 1, // read-only
-        Features    = 2 << 3 | 1, // write-only
-        SectorCount = 2 << 3 | 2,
-        LBALow      = 2 << 3 | 3,
-        LBAMid      = 2 << 3 | 4,
-        LBAHigh     = 2 << 3 | 5,
-        Device      = 2 << 3 | 6,
-        Status      = 2 << 3 | 7, // read-only
-        Command     = 2 << 3 | 7, // write-only
+        AltStatus     = 1 << 3 | 6, // read-only
+        DeviceControl = 1 << 3 | 6, // write-only
+        Data          = 2 << 3 | 0,
+        Error         = 2 << 3 | 1, // read-only
+        Features      = 2 << 3 | 1, // write-only
+        SectorCount   = 2 << 3 | 2,
+        LBALow        = 2 << 3 | 3,
+        LBAMid        = 2 << 3 | 4,
+        LBAHigh       = 2 << 3 | 5,
+        Device        = 2 << 3 | 6,
+        Status        = 2 << 3 | 7, // read-only
+        Command       = 2 << 3 | 7, // write-only
     };
 
     enum ATAStatus
     {
         Status_ERR  = 1 << 0, // error
         Status_DRQ  = 1 << 3, // data request
+        Status_SERV = 1 << 4, // service, a queued command is ready for SERVICE
         Status_DF   = 1 << 5, // device fault
         Status_DRDY = 1 << 6, // device ready
         Status_BSY  = 1 << 7, // busy
     };
 
+    enum ATADeviceControl
+    {
+        DeviceControl_nIEN = 1 << 1, // interrupt disable
+        DeviceControl_SRST = 1 << 2, // software reset
+    };
+
+    enum ATAError
+    {
+        Error_ABRT = 1 << 2, // command aborted
+        Error_ICRC = 1 << 7, // interface CRC error (UDMA)
+    };
+
     enum class ATACommand
     {
+        NOP                    = 0x00,
         DEVICE_RESET           = 0x08,
         READ_SECTOR            = 0x20,
+        READ_SECTOR_EXT        = 0x24,
+        READ_DMA_EXT           = 0x25,
+        READ_DMA_QUEUED_EXT    = 0x26,
+        READ_MULTIPLE_EXT      = 0x29,
         WRITE_SECTOR           = 0x30,
+        WRITE_SECTOR_EXT       = 0x34,
+        WRITE_DMA_EXT          = 0x35,
+        WRITE_DMA_QUEUED_EXT   = 0x36,
+        WRITE_MULTIPLE_EXT     = 0x39,
         PACKET                 = 0xA0,
         IDENTIFY_PACKET_DEVICE = 0xA1,
+        SERVICE                = 0xA2,
+        READ_MULTIPLE          = 0xC4,
+        WRITE_MULTIPLE         = 0xC5,
+        SET_MULTIPLE_MODE      = 0xC6,
+        READ_DMA_QUEUED        = 0xC7,
+        READ_DMA               = 0xC8,
+        WRITE_DMA              = 0xCA,
+        WRITE_DMA_QUEUED       = 0xCC,
+        FLUSH_CACHE            = 0xE7,
+        FLUSH_CACHE_EXT        = 0xEA,
         IDENTIFY_DEVICE        = 0xEC,
         SET_FEATURES           = 0xEF,
     };
@@ -42,19 +75,47 @@ namespace ata
     enum class ATAFeature
     {
         SetTransferMode = 3,
+        EnableServiceInterrupt = 0x5E,
+        DisableServiceInterrupt = 0xDE,
+    };
+
+    // used for read/write_sectors, register access is always PIO
+    enum class TransferMode
+    {
+        PIO,
+        MultiwordDMA,
+        UltraDMA,
     };
 
     // initialisation
     void init_io();
 
+    // selects the fastest PIO mode allowed by the cycle time, register access uses that mode's (slower) register timing
+    // without a device this resets both devices to the same timing (before they are identified)
     void adjust_for_min_cycle_time(int min_cycle_time);
 
+    // the timing and transfer mode are kept for each device and the bus is switched when a device is selected
+    // register access uses the slowest timing of the devices set up with this, as both devices see it
+    void adjust_for_min_cycle_time(int device, int min_cycle_time);
+
     void do_reset();
 
     // register access
     uint16_t read_register(ATAReg reg);
     void write_register(ATAReg reg, uint16_t data);
 
+    struct RegisterWrite
+    {
+        ATAReg reg;
+        uint16_t data;
+    };
+
+    // writes all the registers in order in one burst (the address is set by the SM for each one)
+    void write_registers(const RegisterWrite *writes, int count);
+
+    // writes the Device register (and switches the bus to the device's timing)
+    void select_device(int device);
+
     // helper for convenience
     inline void write_command(ATACommand command)
     {
@@ -70,12 +131,113 @@ namespace ata
     bool do_pio_read(uint16_t *data, int count, uint32_t timeout_ms = 1000);
     bool do_pio_write(const uint16_t *data, int count, uint32_t timeout_ms = 1000);
 
+    // split versions of the above, the data is moved by DMA and the CPU is free until the transfer is finished
+    bool start_pio_read(uint16_t *data, int count, uint32_t timeout_ms = 1000);
+    bool start_pio_write(const uint16_t *data, int count, uint32_t timeout_ms = 1000);
+    bool is_pio_transfer_done();
+    void finish_pio_transfer();
+
     // higher level commands
     bool device_reset(int device);
 
-    int read_sectors(int device, uint32_t lba, int num_sectors, uint16_t *data);
-    int write_sectors(int device, uint32_t lba, int num_sectors, const uint16_t *data);
+    // up to 256 sectors, or 65536 if the device supports 48-bit addressing
+    // (the EXT commands are used if IDENTIFY DEVICE reported support and the LBA/count need them)
+    int read_sectors(int device, uint64_t lba, int num_sectors, uint16_t *data);
+    int write_sectors(int device, uint64_t lba, int num_sectors, const uint16_t *data);
+
+    // asynchronous versions of read/write_sectors
+    // update_commands advances the active command without blocking, then picks the next in LBA order (C-LOOK)
+    // queued commands that continue it on the disk and in memory are merged into one ATA command
+    // a command never passes an earlier one to overlapping sectors if either of them writes
+    // (the other blocking functions shouldn't be used while commands are pending)
+    using CommandHandle = int;
+
+    // returns -1 if too many commands are pending
+    CommandHandle submit_read_sectors(int device, uint64_t lba, int num_sectors, uint16_t *data);
+    CommandHandle submit_write_sectors(int device, uint64_t lba, int num_sectors, const uint16_t *data);
+
+    void update_commands();
+
+    // if the active command is waiting for INTRQ, sleeps until it (or any other event) arrives
+    // returns immediately if interrupts aren't enabled
+    void wait_for_interrupt();
+
+    bool is_command_done(CommandHandle handle);
+
+    // waits for the command if it isn't done, returns the number of sectors transferred and frees the handle
+    int complete_command(CommandHandle handle);
 
     bool identify_device(int device, uint16_t data[256], ATACommand command = ATACommand::IDENTIFY_DEVICE);
     bool set_features(int device, ATAFeature feature, uint8_t sectorCount = 0);
+
+    // sets nIEN, without interrupts the command engine polls the status register
+    // fails if there's no INTRQ pin
+    bool set_interrupts_enabled(bool enabled);
+
+    // checks the device raises INTRQ (the pin may not be connected), interrupts should be enabled first
+    bool test_interrupt(int device);
+
+    // writes anything in the device's write cache to the media
+    bool flush_cache(int device);
+
+    // lets the async commands use READ/WRITE DMA QUEUED (overlapped/queued feature set), 0 disables
+    // the device releases the bus while it works on them and asks for SERVICE when it's ready to transfer the data,
+    // so several can be outstanding, only used in a DMA mode and limited to the number of commands ata can hold
+    // also enables the SERVICE interrupt if the device supports it, otherwise SERV is polled
+    bool set_queue_depth(int device, int depth);
+    int get_queue_depth(int device);
+
+    // sectors per DRQ block for PIO read/write_sectors (READ/WRITE MULTIPLE), 0 disables
+    bool set_multiple_mode(int device, int sectors);
+    int get_multiple_mode(int device);
+
+    // sets the mode on the device (SET FEATURES) and switches read/write_sectors to it
+    // PIO timing still needs adjust_for_min_cycle_time
+    // a UDMA CRC error drops down one mode
+    bool set_transfer_mode(int device, TransferMode mode, int mode_num);
+    TransferMode get_transfer_mode(int device);
+    int get_transfer_mode_num(int device);
+
+    // highest UDMA mode we can read reliably at the current clk_sys
+    int get_max_ultra_dma_mode();
+    unsigned int get_udma_crc_error_count();
+
+    // instrumentation, only recorded if ATA_STATS is enabled in config.h
+    enum class StatsPhase
+    {
+        Taskfile = 0,    // writing the taskfile and command (and starting DMA)
+        BusyWait,        // waiting for !BSY before the command
+        DataRequestWait, // PIO, waiting for DRQ
+        DataTransfer,
+        Completion,      // waiting for !BSY after the data
+
+        Count
+    };
+
+    // read/write_sectors and the async API, other is everything else (polls/errors only)
+    enum class StatsCommandType
+    {
+        Read = 0,
+        Write,
+        Other,
+
+        Count
+    };
+
+    struct CommandStats
+    {
+        uint32_t commands;
+        uint32_t status_polls;
+        uint32_t timeouts;
+        uint32_t errors;
+
+        // clk_sys cycles
+        uint64_t phase_cycles[static_cast<int>(StatsPhase::Count)];
+        uint32_t phase_max_cycles[static_cast<int>(StatsPhase::Count)];
+    };
+
+    // returns false if ATA_STATS is disabled
+    // this may be slightly inconsistent if read while commands are running on the other core
+    bool get_stats(StatsCommandType type, CommandStats &stats);
+    void reset_stats();
 }
\ No newline at end of file
@@ -1,3 +1,7 @@
+#include <algorithm>
+
+#include "pico/time.h"
+
 #include "atapi.hpp"
 
 #include "ata.hpp"
@@ -6,12 +10,27 @@ namespace atapi
 {
     using namespace ata;
 
+    // interrupt reason (in the sector count register)
+    enum InterruptReason
+    {
+        Reason_CoD = 1 << 0, // command/data
+        Reason_IO  = 1 << 1, // to host
+    };
+
+    // largest even byte count limit
+    static const int max_byte_count = 0xFFFE;
+
+    // media accesses may need the disc to spin up
+    static const uint32_t read_timeout_ms = 10000;
+
     void do_command(int device, int max_len, const uint8_t *command)
     {
+        max_len = std::min(max_len, max_byte_count);
+
+        select_device(device);
         write_register(ATAReg::Features, 0);
         write_register(ATAReg::LBAMid, max_len & 0xFF);
         write_register(ATAReg::LBAHigh, (max_len >> 8) & 0xFF);
-        write_register(ATAReg::Device, device << 4 /*device id*/);
         write_command(ATACommand::PACKET);
 
         // assuming 12-byte
@@ -21,6 +40,61 @@ namespace atapi
         read_register(ATAReg::AltStatus);
     }
 
+    int read_data(uint8_t *data, int max_len, uint32_t timeout_ms)
+    {
+        int received = 0;
+
+        while(true)
+        {
+            auto timeout_time = make_timeout_time_ms(timeout_ms);
+            uint8_t status;
+
+            while((status = read_register(ATAReg::Status)) & Status_BSY)
+            {
+                if(time_reached(timeout_time))
+                    return -1;
+            }
+
+            // check condition
+            if(status & Status_ERR)
+                return -1;
+
+            // no more data
+            if(!(status & Status_DRQ))
+                return received;
+
+            // expecting data to the host
+            int reason = read_register(ATAReg::SectorCount);
+            if((reason & (Reason_CoD | Reason_IO)) != Reason_IO)
+                return -1;
+
+            int byte_count = read_register(ATAReg::LBAMid) | read_register(ATAReg::LBAHigh) << 8;
+            int words = (byte_count + 1) / 2;
+
+            // whole words that fit go straight to the buffer
+            int direct_words = (received & 1) ? 0 : std::clamp((max_len - received) / 2, 0, words);
+
+            if(direct_words && !do_pio_read(reinterpret_cast<uint16_t *>(data + received), direct_words, timeout_ms))
+                return -1;
+
+            // then an odd byte at the end and anything that doesn't fit
+            for(int i = direct_words * 2; i < byte_count; i += 2)
+            {
+                uint16_t word = read_register(ATAReg::Data);
+
+                if(received + i < max_len)
+                    data[received + i] = word & 0xFF;
+                if(i + 1 < byte_count && received + i + 1 < max_len)
+                    data[received + i + 1] = word >> 8;
+            }
+
+            received += byte_count;
+
+            // the status isn't valid for the next block until a PIO cycle after this one
+            read_register(ATAReg::AltStatus);
+        }
+    }
+
     SCSISenseKey get_sense_key()
     {
         return static_cast<SCSISenseKey>((read_register(ATAReg::Error) & 0xFF) >> 4);
@@ -44,7 +118,7 @@ namespace atapi
         return true;
     }
 
-    void inquiry(int device, uint8_t *data, int data_len)
+    bool inquiry(int device, uint8_t *data, int data_len)
     {
         // assuming 12-byte
         uint8_t command[12]{};
@@ -57,27 +131,66 @@ namespace atapi
         atapi::do_command(device, data_len, command);
 
         // now the response
-        do_pio_read(reinterpret_cast<uint16_t *>(data), data_len / 2);
+        return read_data(data, data_len) >= 0;
+    }
+
+    bool request_sense(int device, uint8_t *data, int data_len)
+    {
+        uint8_t command[12]{};
+        command[0] = int(SCSICommand::REQUEST_SENSE);
+        command[4] = data_len;
+        command[5] = 0; // control
+        atapi::do_command(device, data_len, command);
+
+        return read_data(data, data_len) >= 0;
     }
 
-    void read(int device, uint32_t lba, uint16_t num_sectors, uint8_t *data, int sector_size)
+    bool read_capacity(int device, uint8_t data[8])
+    {
+        uint8_t command[12]{};
+        command[0] = int(SCSICommand::READ_CAPACITY_10);
+        atapi::do_command(device, 8, command);
+
+        return read_data(data, 8, read_timeout_ms) == 8;
+    }
+
+    bool read(int device, uint32_t lba, uint32_t num_sectors, uint8_t *data, int sector_size)
     {
-        // TODO: multiple sectors probably needs more work...
         int data_len = num_sectors * sector_size;
 
         uint8_t command[12]{};
-        command[0] = int(SCSICommand::READ_10);
         command[1] = 0; // FUA, DPO, RDPROTECT...
         command[2] = lba >> 24;
         command[3] = lba >> 16;
         command[4] = lba >> 8;
         command[5] = lba & 0xFF;
-        command[6] = 0; // group number
-        command[7] = num_sectors >> 8; // len high
-        command[8] = num_sectors; // len low
-        command[9] = 0; // control
-        atapi::do_command(device, data_len, command);
 
-        do_pio_read(reinterpret_cast<uint16_t *>(data), data_len / 2);
+        if(num_sectors > 0xFFFF)
+        {
+            command[0] = int(SCSICommand::READ_12);
+            command[6] = num_sectors >> 24;
+            command[7] = num_sectors >> 16;
+            command[8] = num_sectors >> 8;
+            command[9] = num_sectors;
+            command[10] = 0; // group number
+            command[11] = 0; // control
+        }
+        else
+        {
+            command[0] = int(SCSICommand::READ_10);
+            command[6] = 0; // group number
+            command[7] = num_sectors >> 8; // len high
+            command[8] = num_sectors; // len low
+            command[9] = 0; // control
+        }
+
+        // whole sectors per DRQ block, as many as fit in the byte count
+        int block_len = std::min(data_len, max_byte_count);
+        if(block_len >= sector_size)
+            block_len -= block_len % sector_size;
+
+        atapi::do_command(device, block_len, command);
+
+        return read_data(data, data_len, read_timeout_ms) == data_len;
     }
 }
\ No newline at end of file
@@ -5,13 +5,26 @@
 
 namespace atapi
 {
+    // max_len is the byte count limit for each DRQ block of the data phase (limited to 0xFFFE)
     void do_command(int device, int max_len, const uint8_t *command);
 
+    // reads the data phase of a command, which the device may split into multiple DRQ blocks
+    // anything past max_len is read and discarded
+    // returns the number of bytes the device sent, or -1 on an error (see get_sense_key)
+    int read_data(uint8_t *data, int max_len, uint32_t timeout_ms = 1000);
+
     SCSISenseKey get_sense_key();
 
     bool test_unit_ready(int device);
 
-    void inquiry(int device, uint8_t *data, int data_len=36);
+    bool inquiry(int device, uint8_t *data, int data_len=36);
+
+    // fixed format sense data, the key is in data[2] and the ASC/ASCQ in data[12-13]
+    bool request_sense(int device, uint8_t *data, int data_len=18);
+
+    // last LBA and block size (big-endian)
+    bool read_capacity(int device, uint8_t data[8]);
 
-    void read(int device, uint32_t lba, uint16_t num_sectors, uint8_t *data, int sector_size = 2048);
+    // uses READ(12) if the count doesn't fit in READ(10)
+    bool read(int device, uint32_t lba, uint32_t num_sectors, uint8_t *data, int sector_size = 2048);
 }
\ No newline at end of file
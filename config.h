@@ -17,8 +17,21 @@
 
 #define ATA_IORDY_PIN     23
 
+#define ATA_DMARQ_PIN     24
+
+#define ATA_DMACK_PIN     25
+
+// optional, comment out if not connected to poll the status register instead
+// (pico-ata-usb also checks it at startup and polls if the device never raises it)
+#define ATA_INTRQ_PIN     26
+
 #define ATA_RESET_PIN     27
 
+// record per-phase command timings and counters (ata::get_stats), adds a little overhead to every command
+#ifndef ATA_STATS
+#define ATA_STATS 0
+#endif
+
 // masks
 #define ATA_DATA_PIN_MASK  (0xFFFF << ATA_DATA_PIN_BASE)
 #define ATA_CS_PIN_MASK    (     3 << ATA_CS_PIN_BASE)
@@ -26,6 +39,14 @@
 #define ATA_READ_PIN_MASK  (     1 << ATA_READ_PIN)
 #define ATA_WRITE_PIN_MASK (     1 << ATA_WRITE_PIN)
 #define ATA_IORDY_PIN_MASK (     1 << ATA_IORDY_PIN)
+#define ATA_DMARQ_PIN_MASK (     1 << ATA_DMARQ_PIN)
+#define ATA_DMACK_PIN_MASK (     1 << ATA_DMACK_PIN)
 #define ATA_RESET_PIN_MASK (     1 << ATA_RESET_PIN)
 
-#define ATA_IO_MASK (ATA_DATA_PIN_MASK | ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK | ATA_READ_PIN_MASK | ATA_WRITE_PIN_MASK | ATA_IORDY_PIN_MASK | ATA_RESET_PIN_MASK)
\ No newline at end of file
+#ifdef ATA_INTRQ_PIN
+#define ATA_INTRQ_PIN_MASK (     1 << ATA_INTRQ_PIN)
+#else
+#define ATA_INTRQ_PIN_MASK 0
+#endif
+
+#define ATA_IO_MASK (ATA_DATA_PIN_MASK | ATA_CS_PIN_MASK | ATA_ADDR_PIN_MASK | ATA_READ_PIN_MASK | ATA_WRITE_PIN_MASK | ATA_IORDY_PIN_MASK | ATA_DMARQ_PIN_MASK | ATA_DMACK_PIN_MASK | ATA_RESET_PIN_MASK | ATA_INTRQ_PIN_MASK)
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include <algorithm>
+
+#include "device-profile.hpp"
+#include "identity.hpp"
+
+namespace ata
+{
+    void parse_device_profile(const uint16_t data[256], DeviceProfile &profile)
+    {
+        IdentityParser parser(data);
+
+        profile = {};
+
+        profile.valid = true;
+        profile.is_atapi = parser.is_atapi();
+        profile.removable = parser.is_removable();
+
+        parser.model_number(profile.model);
+        parser.serial_number(profile.serial);
+        parser.firmware_revision(profile.firmware);
+
+        if(profile.is_atapi)
+            profile.sector_size = 2048; // probably, READ CAPACITY will tell us
+        else if(parser.address_48bit_supported())
+        {
+            profile.address_48bit = true;
+            profile.num_sectors = parser.total_user_addressable_sectors_48bit();
+        }
+        else
+            profile.num_sectors = parser.total_user_addressable_sectors();
+
+        // "advanced" PIO modes (3-4), modes 0-2 use word 51
+        if(parser.timing_params_valid())
+        {
+            auto adv_pio_modes = parser.advanced_pio_modes_supported();
+
+            if(adv_pio_modes)
+                profile.max_pio_mode = (adv_pio_modes & (1 << 1)) ? 4 : 3;
+
+            profile.min_pio_cycle_time = parser.min_pio_cycle_time_iordy();
+        }
+
+        if(parser.dma_supported())
+            profile.multiword_dma_modes = parser.multiword_dma_modes_supported() & 7;
+
+        if(parser.ultra_dma_modes_valid())
+            profile.ultra_dma_modes = parser.ultra_dma_modes_supported() & 0x3F;
+
+        profile.cable_80_conductor = parser.cable_80_conductor_detected();
+
+        // the block size should be a power of two
+        int max_multiple = parser.max_read_write_multiple();
+        if(!profile.is_atapi && max_multiple > 1)
+            profile.max_multiple = 1 << (31 - __builtin_clz(max_multiple));
+
+        if(parser.command_set_notification_supported())
+        {
+            profile.write_cache = parser.write_cache_supported();
+            profile.flush_cache = parser.flush_cache_supported();
+
+            if(!profile.is_atapi && parser.rw_dma_queued_supported())
+                profile.queue_depth = parser.queue_depth();
+        }
+    }
+
+    bool read_device_profile(int device, DeviceProfile &profile, ATACommand command)
+    {
+        uint16_t data[256];
+
+        if(!identify_device(device, data, command))
+        {
+            profile.valid = false;
+            return false;
+        }
+
+        parse_device_profile(data, profile);
+
+        return true;
+    }
+
+    void setup_transfer_modes(int device, const DeviceProfile &profile)
+    {
+        // set "advanced" PIO mode (with flow control)
+        if(profile.max_pio_mode >= 3)
+            set_transfer_mode(device, TransferMode::PIO, profile.max_pio_mode);
+
+        // reconfigure for speed
+        adjust_for_min_cycle_time(device, profile.min_pio_cycle_time);
+
+        // transfer as many sectors per DRQ block as possible, only used without DMA
+        if(profile.max_multiple)
+            set_multiple_mode(device, profile.max_multiple);
+
+        // use DMA for data if available, preferring UDMA
+        if(profile.ultra_dma_modes)
+        {
+            int mode = 31 - __builtin_clz(profile.ultra_dma_modes);
+
+            // modes above 2 need an 80-conductor cable
+            if(!profile.cable_80_conductor)
+                mode = std::min(mode, 2);
+
+            mode = std::min(mode, get_max_ultra_dma_mode());
+            set_transfer_mode(device, TransferMode::UltraDMA, mode);
+        }
+        else if(profile.multiword_dma_modes)
+        {
+            int mode = 31 - __builtin_clz(profile.multiword_dma_modes);
+            set_transfer_mode(device, TransferMode::MultiwordDMA, mode);
+        }
+
+        // let the device reorder commands itself if it can queue them
+        if(profile.queue_depth > 1 && get_transfer_mode(device) != TransferMode::PIO)
+            set_queue_depth(device, profile.queue_depth);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdint>
+
+#include "ata.hpp"
+
+namespace ata
+{
+    // what we need to know about a device after detection
+    // built from IDENTIFY (PACKET) DEVICE once, instead of identifying the device again every time
+    struct DeviceProfile
+    {
+        bool valid = false;
+        bool is_atapi = false;
+        bool removable = false;
+
+        // null terminated, padded with spaces
+        char model[41];
+        char serial[21];
+        char firmware[9];
+
+        // ATA only, ATAPI devices need READ CAPACITY
+        uint64_t num_sectors = 0;
+        int sector_size = 512;
+        bool address_48bit = false;
+
+        // transfer modes
+        int max_pio_mode = 0;
+        int min_pio_cycle_time = 600; // ns
+        uint8_t multiword_dma_modes = 0; // bitmask
+        uint8_t ultra_dma_modes = 0;
+        bool cable_80_conductor = false;
+        int max_multiple = 0; // sectors per DRQ block for READ/WRITE MULTIPLE
+        int queue_depth = 0; // READ/WRITE DMA QUEUED, 0 if not supported
+
+        // features
+        bool write_cache = false;
+        bool flush_cache = false;
+    };
+
+    void parse_device_profile(const uint16_t data[256], DeviceProfile &profile);
+
+    bool read_device_profile(int device, DeviceProfile &profile, ATACommand command = ATACommand::IDENTIFY_DEVICE);
+
+    // sets the fastest PIO/DMA modes and multiple count the device, cable and clock allow
+    void setup_transfer_modes(int device, const DeviceProfile &profile);
+}
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "pico/time.h"
+
+#include "ata-bus.hpp"
+#include "sim-drive.hpp"
+
+using ata::ATAReg;
+using ata::TransferMode;
+using ata::bus::TransferStatus;
+
+// the devices on the simulated bus, configured from the environment:
+// ATA_SIM_DEVICE0/1 = [atapi:]image path
+// ATA_SIM_TIMING = hdd (default), ssd or none
+static ata_sim::Drive drives[2];
+static int selected_device = 0;
+
+// bus timing, the transfers happen instantly but take this long to complete
+static int pio_cycle_time = 600; // ns
+static TransferMode data_transfer_mode = TransferMode::PIO;
+static int data_transfer_mode_num = 0;
+
+static uint64_t transfer_end_time = 0; // us
+
+// DMA
+static bool dma_active = false, dma_started = false;
+static uint16_t *dma_read_data = nullptr;
+static const uint16_t *dma_write_data = nullptr;
+static int dma_words = 0;
+
+static bool interrupts_enabled = false;
+
+static uint64_t get_transfer_end_time(int words, int word_time_ns)
+{
+    return time_us_64() + (uint64_t(words) * word_time_ns + 999) / 1000;
+}
+
+// ns per word for the current DMA mode
+static int get_dma_word_time()
+{
+    static const int mwdma_cycle_time[]{480, 150, 120};
+    static const int udma_word_time[]{120, 80, 60, 45, 30, 20};
+
+    if(data_transfer_mode == TransferMode::MultiwordDMA)
+        return mwdma_cycle_time[data_transfer_mode_num];
+
+    return udma_word_time[data_transfer_mode_num];
+}
+
+static void open_drive(int index, const char *env_name)
+{
+    const char *path = getenv(env_name);
+
+    if(!path || !*path)
+        return;
+
+    bool atapi = strncmp(path, "atapi:", 6) == 0;
+    if(atapi)
+        path += 6;
+
+    if(!drives[index].open(path, index, atapi))
+        fprintf(stderr, "failed to open %s for device %i\n", path, index);
+}
+
+namespace ata::bus
+{
+    void init()
+    {
+        open_drive(0, "ATA_SIM_DEVICE0");
+        open_drive(1, "ATA_SIM_DEVICE1");
+
+        auto timing = &ata_sim::hdd_timing;
+
+        if(auto timing_name = getenv("ATA_SIM_TIMING"))
+        {
+            if(strcmp(timing_name, "ssd") == 0)
+                timing = &ata_sim::ssd_timing;
+            else if(strcmp(timing_name, "none") == 0)
+                timing = &ata_sim::no_timing;
+        }
+
+        for(auto &drive : drives)
+            drive.set_timing(*timing);
+
+        if(!drives[0].is_open() && !drives[1].is_open())
+            fprintf(stderr, "no simulated devices, set ATA_SIM_DEVICE0/1\n");
+    }
+
+    void hardware_reset()
+    {
+        for(auto &drive : drives)
+        {
+            if(drive.is_open())
+                drive.reset();
+        }
+    }
+
+    // register access time isn't simulated
+    void set_pio_timing(int min_cycle_time, int)
+    {
+        static const int cycle_time[]{600, 383, 240, 180, 120};
+
+        // same mode selection as the real bus
+        int mode = 4;
+        while(mode > 0 && cycle_time[mode] < min_cycle_time)
+            mode--;
+
+        pio_cycle_time = std::max(cycle_time[mode], min_cycle_time);
+    }
+
+    uint16_t read_register(ATAReg reg)
+    {
+        auto &drive = drives[selected_device];
+
+        if(!drive.is_open())
+            return 0;
+
+        if(reg == ATAReg::Data)
+        {
+            uint16_t data = 0;
+            drive.read_data(&data, 1, time_us_64());
+            return data;
+        }
+
+        return drive.read_register(reg);
+    }
+
+    void write_registers(const RegisterWrite *writes, int count)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(writes[i].reg == ATAReg::Device)
+                selected_device = (writes[i].data >> 4) & 1;
+
+            for(auto &drive : drives)
+            {
+                if(!drive.is_open())
+                    continue;
+
+                if(writes[i].reg == ATAReg::Data)
+                    drive.write_data(&writes[i].data, 1, time_us_64());
+                else
+                    drive.write_register(writes[i].reg, writes[i].data);
+            }
+        }
+    }
+
+    void start_pio_read(uint16_t *data, int count)
+    {
+        assert(count > 0);
+
+        transfer_end_time = get_transfer_end_time(count, pio_cycle_time);
+
+        if(drives[selected_device].is_open())
+            drives[selected_device].read_data(data, count, transfer_end_time);
+    }
+
+    void start_pio_write(const uint16_t *data, int count)
+    {
+        assert(count > 0);
+
+        transfer_end_time = get_transfer_end_time(count, pio_cycle_time);
+
+        if(drives[selected_device].is_open())
+            drives[selected_device].write_data(data, count, transfer_end_time);
+    }
+
+    bool is_transfer_done()
+    {
+        return time_reached(transfer_end_time);
+    }
+
+    bool finish_transfer(uint32_t)
+    {
+        sleep_until(transfer_end_time);
+        return true;
+    }
+
+    void abort_transfer()
+    {
+        transfer_end_time = 0;
+        dma_active = false;
+    }
+
+    // there's nothing to offload the polling to
+    bool has_status_poll()
+    {
+        return false;
+    }
+
+    void start_status_poll(int)
+    {
+    }
+
+    bool get_polled_status(uint8_t &)
+    {
+        return false;
+    }
+
+    void continue_polled_read(uint16_t *, int)
+    {
+    }
+
+    void reset_status_poll()
+    {
+    }
+
+    void wait_for_status_poll(absolute_time_t)
+    {
+    }
+
+    void set_transfer_mode(TransferMode mode, int mode_num)
+    {
+        data_transfer_mode = mode;
+        data_transfer_mode_num = mode_num;
+    }
+
+    int get_max_ultra_dma_mode()
+    {
+        return 5;
+    }
+
+    void start_dma_read(const RegisterWrite *taskfile, int taskfile_len, uint16_t *data, int count)
+    {
+        ata::bus::write_registers(taskfile, taskfile_len);
+
+        dma_active = true;
+        dma_started = false;
+        dma_read_data = data;
+        dma_write_data = nullptr;
+        dma_words = count;
+    }
+
+    void start_dma_write(const RegisterWrite *taskfile, int taskfile_len, const uint16_t *data, int count)
+    {
+        ata::bus::write_registers(taskfile, taskfile_len);
+
+        dma_active = true;
+        dma_started = false;
+        dma_read_data = nullptr;
+        dma_write_data = data;
+        dma_words = count;
+    }
+
+    // the whole transfer is a single burst once the device requests it
+    TransferStatus update_dma_transfer(absolute_time_t)
+    {
+        if(!dma_active)
+            return TransferStatus::Failed;
+
+        auto &drive = drives[selected_device];
+
+        if(!dma_started)
+        {
+            if(!drive.is_open() || !drive.is_dma_requested())
+                return TransferStatus::Running;
+
+            transfer_end_time = get_transfer_end_time(dma_words, get_dma_word_time());
+            drive.transfer_dma(dma_read_data, dma_write_data, dma_words, transfer_end_time);
+            dma_started = true;
+        }
+
+        if(!time_reached(transfer_end_time))
+            return TransferStatus::Running;
+
+        dma_active = false;
+        return TransferStatus::Done;
+    }
+
+    bool has_interrupt()
+    {
+        return true;
+    }
+
+    void set_interrupts_enabled(bool enabled)
+    {
+        interrupts_enabled = enabled;
+    }
+
+    bool check_interrupt()
+    {
+        if(!interrupts_enabled)
+            return true;
+
+        return drives[selected_device].is_open() && drives[selected_device].get_interrupt();
+    }
+
+    // INTRQ is cleared by reading the status
+    void clear_interrupt()
+    {
+    }
+
+    void wait_for_interrupt(absolute_time_t timeout_time)
+    {
+        if(check_interrupt())
+            return;
+
+        // sleep until something happens, or a short while if nothing is scheduled
+        uint64_t wake_time = std::min(timeout_time, make_timeout_time_us(1000));
+
+        for(auto &drive : drives)
+        {
+            auto event_time = drive.get_next_event_time();
+            if(event_time)
+                wake_time = std::min(wake_time, event_time);
+        }
+
+        sleep_until(wake_time);
+    }
+}
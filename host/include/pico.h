@@ -0,0 +1,5 @@
+#pragma once
+
+// just enough of the Pico SDK for the host build
+#include <cassert>
+#include <cstdint>
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdio>
+
+#include "pico.h"
+#include "pico/time.h"
+
+// stdio is the terminal
+inline bool stdio_init_all()
+{
+    return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+#include "pico.h"
+
+// microseconds since startup
+typedef uint64_t absolute_time_t;
+
+inline uint64_t time_us_64()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline absolute_time_t get_absolute_time()
+{
+    return time_us_64();
+}
+
+inline uint32_t to_ms_since_boot(absolute_time_t t)
+{
+    return t / 1000;
+}
+
+inline absolute_time_t make_timeout_time_us(uint64_t us)
+{
+    return time_us_64() + us;
+}
+
+inline absolute_time_t make_timeout_time_ms(uint32_t ms)
+{
+    return make_timeout_time_us(uint64_t(ms) * 1000);
+}
+
+inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us)
+{
+    return t + us;
+}
+
+inline bool time_reached(absolute_time_t t)
+{
+    return time_us_64() >= t;
+}
+
+inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to)
+{
+    return int64_t(to - from);
+}
+
+inline void sleep_until(absolute_time_t t)
+{
+    auto now = time_us_64();
+    if(t > now)
+        std::this_thread::sleep_for(std::chrono::microseconds(t - now));
+}
+
+inline void sleep_us(uint64_t us)
+{
+    sleep_until(make_timeout_time_us(us));
+}
+
+inline void sleep_ms(uint32_t ms)
+{
+    sleep_us(uint64_t(ms) * 1000);
+}
+
+// there are no events, so this only gives up the CPU
+inline bool best_effort_wfe_or_timeout(absolute_time_t timeout_time)
+{
+    std::this_thread::yield();
+    return time_reached(timeout_time);
+}
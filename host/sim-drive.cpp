@@ -0,0 +1,1115 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pico/time.h"
+
+#include "sim-drive.hpp"
+#include "scsi.hpp"
+
+using ata::ATACommand;
+using ata::ATAReg;
+
+namespace ata_sim
+{
+    // a 7200rpm disk
+    const DriveTiming hdd_timing{50, 1000, 18000, 8333, 100000, 10000};
+    const DriveTiming ssd_timing{20, 60, 60, 0, 250000, 1000};
+    const DriveTiming no_timing{0, 0, 0, 0, 0, 0};
+
+    enum Status
+    {
+        Status_ERR  = 1 << 0,
+        Status_DRQ  = 1 << 3,
+        Status_DSC  = 1 << 4,
+        Status_SERV = 1 << 4, // same bit, while commands are queued
+        Status_DRDY = 1 << 6,
+        Status_BSY  = 1 << 7,
+    };
+
+    enum Error
+    {
+        Error_ABRT = 1 << 2,
+        Error_IDNF = 1 << 4,
+        Error_UNC  = 1 << 6,
+    };
+
+    // ATAPI/queued command interrupt reason (in the sector count register)
+    enum InterruptReason
+    {
+        Reason_CoD = 1 << 0,
+        Reason_IO  = 1 << 1,
+        Reason_REL = 1 << 2, // bus released
+    };
+
+    static void set_string(uint16_t *data, const char *str, int len)
+    {
+        // space padded, first char in the high byte
+        for(int i = 0; i < len; i += 2)
+        {
+            int c0 = *str ? *str++ : ' ';
+            int c1 = *str ? *str++ : ' ';
+            data[i / 2] = c0 << 8 | c1;
+        }
+    }
+
+    Drive::~Drive()
+    {
+        if(fd != -1)
+            close(fd);
+    }
+
+    bool Drive::open(const char *path, int index, bool atapi)
+    {
+        fd = ::open(path, O_RDWR);
+
+        if(fd == -1)
+            return false;
+
+        this->index = index;
+        this->atapi = atapi;
+        sector_size = atapi ? 2048 : 512;
+        num_sectors = lseek(fd, 0, SEEK_END) / sector_size;
+
+        reset();
+
+        return true;
+    }
+
+    void Drive::reset()
+    {
+        state = State::Ready;
+        status = 0;
+        interrupt_pending = false;
+        multiple_sectors = 0;
+        packet_device_ready = false;
+        device = 0;
+
+        clear_queue();
+        service_interrupt = false;
+
+        set_signature();
+
+        // the reset is reported once to ATAPI commands
+        unit_attention = atapi;
+
+        set_busy(time_us_64() + timing.reset_time, BusyAction::Complete);
+        busy_error = 0;
+    }
+
+    void Drive::write_register(ATAReg reg, uint8_t data)
+    {
+        update();
+
+        switch(reg)
+        {
+            case ATAReg::Command:
+                if(is_selected() && !(status & Status_BSY))
+                    execute_command(static_cast<ATACommand>(data));
+                break;
+
+            case ATAReg::DeviceControl:
+                // SRST resets both devices
+                if((data & ata::DeviceControl_SRST) && !(device_control & ata::DeviceControl_SRST))
+                    reset();
+
+                device_control = data;
+                break;
+
+            case ATAReg::Features:
+                features[1] = features[0];
+                features[0] = data;
+                break;
+            case ATAReg::SectorCount:
+                sector_count[1] = sector_count[0];
+                sector_count[0] = data;
+                break;
+            case ATAReg::LBALow:
+                lba_low[1] = lba_low[0];
+                lba_low[0] = data;
+                break;
+            case ATAReg::LBAMid:
+                lba_mid[1] = lba_mid[0];
+                lba_mid[0] = data;
+                break;
+            case ATAReg::LBAHigh:
+                lba_high[1] = lba_high[0];
+                lba_high[0] = data;
+                break;
+            case ATAReg::Device:
+                device = data;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    uint8_t Drive::read_register(ATAReg reg)
+    {
+        update();
+
+        // HOB reads back the previous value
+        int hob = (device_control & 0x80) ? 1 : 0;
+
+        switch(reg)
+        {
+            case ATAReg::Status:
+                interrupt_pending = false;
+                return status;
+            case ATAReg::AltStatus:
+                return status;
+            case ATAReg::Error:
+                return error;
+            case ATAReg::SectorCount:
+                return sector_count[hob];
+            case ATAReg::LBALow:
+                return lba_low[hob];
+            case ATAReg::LBAMid:
+                return lba_mid[hob];
+            case ATAReg::LBAHigh:
+                return lba_high[hob];
+            case ATAReg::Device:
+                return device;
+            default:
+                return 0xFF;
+        }
+    }
+
+    int Drive::read_data(uint16_t *data, int count, uint64_t end_time)
+    {
+        update();
+
+        if(state != State::DataIn)
+            return 0;
+
+        count = std::min(count, buffer_len - buffer_pos);
+        memcpy(data, buffer.data() + buffer_pos, count * 2);
+        buffer_pos += count;
+
+        if(buffer_pos < buffer_len)
+            return count;
+
+        if(atapi)
+        {
+            // next chunk or done
+            if(packet_bytes_left)
+                set_busy(end_time + get_media_time(std::min(packet_bytes_left, byte_count_limit)), BusyAction::PacketData);
+            else
+            {
+                sector_count[0] = Reason_CoD | Reason_IO;
+                set_busy(end_time, BusyAction::Complete);
+            }
+        }
+        else if(sectors_left)
+            set_busy(end_time + get_media_time(std::min(sectors_left, block_sectors) * sector_size), BusyAction::ReadBlock);
+        else
+        {
+            // no interrupt after the last block
+            state = State::Ready;
+            status = get_ready_status();
+        }
+
+        return count;
+    }
+
+    int Drive::write_data(const uint16_t *data, int count, uint64_t end_time)
+    {
+        update();
+
+        if(state == State::Packet)
+        {
+            count = std::min(count, buffer_len - buffer_pos);
+            memcpy(buffer.data() + buffer_pos, data, count * 2);
+            buffer_pos += count;
+
+            if(buffer_pos == buffer_len)
+            {
+                memcpy(packet, buffer.data(), sizeof(packet));
+                state = State::Busy;
+                status = Status_BSY;
+                busy_until = end_time;
+                execute_packet();
+            }
+
+            return count;
+        }
+
+        if(state != State::DataOut)
+            return 0;
+
+        count = std::min(count, buffer_len - buffer_pos);
+        memcpy(buffer.data() + buffer_pos, data, count * 2);
+        buffer_pos += count;
+
+        if(buffer_pos == buffer_len)
+            finish_write_block(end_time);
+
+        return count;
+    }
+
+    bool Drive::is_dma_requested()
+    {
+        update();
+        return state == State::DMA;
+    }
+
+    int Drive::transfer_dma(uint16_t *read_data, const uint16_t *write_data, int count, uint64_t end_time)
+    {
+        update();
+
+        if(state != State::DMA)
+            return 0;
+
+        int words_per_sector = sector_size / 2;
+        int sectors = std::min(count / words_per_sector, sectors_left);
+
+        bool ok = read_data ? read_sectors(command_lba, sectors, read_data) : write_sectors(command_lba, sectors, write_data);
+
+        command_lba += sectors;
+        sectors_left -= sectors;
+
+        if(!ok)
+            complete(Error_UNC);
+        else if(!sectors_left)
+        {
+            // writes go to the media before completing
+            uint64_t write_time = write_data ? write_access_time + get_media_time(sectors * sector_size) : 0;
+            set_busy(end_time + write_time, BusyAction::Complete);
+        }
+
+        return sectors * words_per_sector;
+    }
+
+    bool Drive::get_interrupt()
+    {
+        update();
+        return interrupt_pending && is_selected() && !(device_control & ata::DeviceControl_nIEN);
+    }
+
+    uint64_t Drive::get_next_event_time() const
+    {
+        if(state == State::Busy)
+            return busy_until;
+
+        return media_tag != -1 && !service_ready ? media_ready_time : 0;
+    }
+
+    void Drive::update()
+    {
+        if(state == State::Busy && time_us_64() >= busy_until)
+            end_busy();
+
+        update_queue();
+    }
+
+    void Drive::set_busy(uint64_t until, BusyAction action)
+    {
+        state = State::Busy;
+        status = Status_BSY;
+        busy_until = until;
+        busy_action = action;
+    }
+
+    void Drive::end_busy()
+    {
+        switch(busy_action)
+        {
+            case BusyAction::Complete:
+                complete(busy_error);
+                busy_error = 0;
+                break;
+
+            case BusyAction::ReadBlock:
+                read_block();
+                break;
+
+            case BusyAction::WriteBlock:
+                // ready for the next block, no interrupt before the first one
+                buffer_pos = 0;
+                buffer_len = std::min(sectors_left, block_sectors) * sector_size / 2;
+                buffer.resize(buffer_len);
+
+                state = State::DataOut;
+                status = get_ready_status() | Status_DRQ;
+
+                if(!first_block)
+                    interrupt_pending = true;
+                first_block = false;
+                break;
+
+            case BusyAction::StartDMA:
+                state = State::DMA;
+                status = get_ready_status() | Status_DRQ;
+                break;
+
+            case BusyAction::RequestPacket:
+                buffer_pos = 0;
+                buffer_len = sizeof(packet) / 2;
+                buffer.resize(buffer_len);
+
+                state = State::Packet;
+                status = Status_DRDY | Status_DRQ;
+                sector_count[0] = Reason_CoD;
+                break;
+
+            case BusyAction::PacketData:
+                packet_data_block();
+                break;
+
+            case BusyAction::Release:
+                // no release interrupt
+                sector_count[0] |= Reason_REL;
+                state = State::Ready;
+                status = get_ready_status();
+                break;
+        }
+    }
+
+    void Drive::complete(uint8_t error)
+    {
+        this->error = error;
+
+        if(data_tag != -1)
+        {
+            // an error aborts everything else that's queued
+            if(error)
+                clear_queue();
+            else
+            {
+                queue[data_tag].active = false;
+                num_queued--;
+                data_tag = -1;
+            }
+        }
+
+        state = State::Ready;
+        status = (atapi && !packet_device_ready ? uint8_t(Status_DSC) : get_ready_status()) | (error ? Status_ERR : 0);
+
+        interrupt_pending = true;
+    }
+
+    void Drive::abort()
+    {
+        set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+        busy_error = Error_ABRT;
+    }
+
+    uint8_t Drive::get_ready_status() const
+    {
+        if(num_queued)
+            return Status_DRDY | (service_ready ? Status_SERV : 0);
+
+        return Status_DRDY | Status_DSC;
+    }
+
+    void Drive::set_signature()
+    {
+        error = 1; // diagnostic passed
+        sector_count[0] = lba_low[0] = 1;
+        lba_mid[0] = atapi ? 0x14 : 0;
+        lba_high[0] = atapi ? 0xEB : 0;
+    }
+
+    // the time until the first sector is under the head
+    uint64_t Drive::get_access_time(uint64_t lba, int count)
+    {
+        uint64_t time = timing.command_time;
+
+        if(lba != next_lba)
+        {
+            // as a fraction of the whole disk
+            uint64_t distance = lba > next_lba ? lba - next_lba : next_lba - lba;
+            double fraction = num_sectors ? double(distance) / num_sectors : 1.0;
+
+            time += timing.track_to_track_time + (timing.full_stroke_time - timing.track_to_track_time) * std::sqrt(std::min(fraction, 1.0));
+            time += timing.rotation_time / 2;
+        }
+
+        next_lba = lba + count;
+
+        return time;
+    }
+
+    int Drive::get_media_time(int bytes) const
+    {
+        if(!timing.media_rate)
+            return 0;
+
+        return uint64_t(bytes) * 1000 / timing.media_rate;
+    }
+
+    void Drive::execute_command(ATACommand command)
+    {
+        error = 0;
+        interrupt_pending = false;
+
+        bool queue_command_ok = command == ATACommand::READ_DMA_QUEUED || command == ATACommand::READ_DMA_QUEUED_EXT
+                             || command == ATACommand::WRITE_DMA_QUEUED || command == ATACommand::WRITE_DMA_QUEUED_EXT
+                             || command == ATACommand::SERVICE;
+
+        // anything else aborts the queue
+        if(num_queued && !queue_command_ok)
+        {
+            clear_queue();
+            abort();
+            return;
+        }
+
+        switch(command)
+        {
+            case ATACommand::IDENTIFY_DEVICE:
+            case ATACommand::IDENTIFY_PACKET_DEVICE:
+            {
+                bool packet = command == ATACommand::IDENTIFY_PACKET_DEVICE;
+
+                // ATAPI devices abort IDENTIFY DEVICE with the signature set, so it can be detected
+                if(packet != atapi)
+                {
+                    if(atapi)
+                        set_signature();
+                    abort();
+                    break;
+                }
+
+                identify(packet);
+
+                sectors_left = 0;
+                set_busy(time_us_64() + timing.command_time, BusyAction::ReadBlock);
+                break;
+            }
+
+            case ATACommand::READ_SECTOR:
+                start_sector_command(false, false, false, 1);
+                break;
+            case ATACommand::READ_SECTOR_EXT:
+                start_sector_command(false, false, true, 1);
+                break;
+            case ATACommand::READ_MULTIPLE:
+                start_sector_command(false, false, false, multiple_sectors);
+                break;
+            case ATACommand::READ_MULTIPLE_EXT:
+                start_sector_command(false, false, true, multiple_sectors);
+                break;
+            case ATACommand::READ_DMA:
+                start_sector_command(false, true, false, 0);
+                break;
+            case ATACommand::READ_DMA_EXT:
+                start_sector_command(false, true, true, 0);
+                break;
+
+            case ATACommand::WRITE_SECTOR:
+                start_sector_command(true, false, false, 1);
+                break;
+            case ATACommand::WRITE_SECTOR_EXT:
+                start_sector_command(true, false, true, 1);
+                break;
+            case ATACommand::WRITE_MULTIPLE:
+                start_sector_command(true, false, false, multiple_sectors);
+                break;
+            case ATACommand::WRITE_MULTIPLE_EXT:
+                start_sector_command(true, false, true, multiple_sectors);
+                break;
+            case ATACommand::WRITE_DMA:
+                start_sector_command(true, true, false, 0);
+                break;
+            case ATACommand::WRITE_DMA_EXT:
+                start_sector_command(true, true, true, 0);
+                break;
+
+            case ATACommand::READ_DMA_QUEUED:
+                queue_command(false, false);
+                break;
+            case ATACommand::READ_DMA_QUEUED_EXT:
+                queue_command(false, true);
+                break;
+            case ATACommand::WRITE_DMA_QUEUED:
+                queue_command(true, false);
+                break;
+            case ATACommand::WRITE_DMA_QUEUED_EXT:
+                queue_command(true, true);
+                break;
+
+            case ATACommand::SERVICE:
+                service();
+                break;
+
+            case ATACommand::SET_MULTIPLE_MODE:
+            {
+                int count = sector_count[0];
+
+                // 0 disables, otherwise a power of two up to the max
+                if(atapi || count > max_multiple_sectors || (count & (count - 1)))
+                {
+                    abort();
+                    break;
+                }
+
+                multiple_sectors = count;
+                set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+                break;
+            }
+
+            case ATACommand::SET_FEATURES:
+                // transfer mode, enable/disable write cache
+                if(features[0] == 0x03 || features[0] == 0x02 || features[0] == 0x82)
+                    set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+                else if(!atapi && (features[0] == 0x5E || features[0] == 0xDE))
+                {
+                    // enable/disable the SERVICE interrupt
+                    service_interrupt = features[0] == 0x5E;
+                    set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+                }
+                else
+                    abort();
+                break;
+
+            case ATACommand::FLUSH_CACHE:
+            case ATACommand::FLUSH_CACHE_EXT:
+                if(atapi)
+                    abort();
+                else
+                {
+                    fsync(fd);
+                    set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+                }
+                break;
+
+            case ATACommand::DEVICE_RESET:
+                // only for packet devices
+                if(!atapi)
+                {
+                    abort();
+                    break;
+                }
+
+                set_signature();
+                state = State::Ready;
+                status = Status_DSC;
+                break;
+
+            case ATACommand::PACKET:
+                if(!atapi)
+                {
+                    abort();
+                    break;
+                }
+
+                byte_count_limit = lba_mid[0] | lba_high[0] << 8;
+
+                // 0 isn't valid, but the largest even count is a reasonable guess
+                if(!byte_count_limit || byte_count_limit == 0xFFFF)
+                    byte_count_limit = 0xFFFE;
+                else if(byte_count_limit > 1)
+                    byte_count_limit &= ~1; // odd limits are only for the last block
+
+                set_busy(time_us_64() + timing.command_time, BusyAction::RequestPacket);
+                break;
+
+            default:
+                abort();
+                break;
+        }
+    }
+
+    void Drive::start_sector_command(bool write, bool dma, bool ext, int block_sectors)
+    {
+        // multiple commands need SET MULTIPLE MODE first
+        if(atapi || (!dma && !block_sectors))
+        {
+            abort();
+            return;
+        }
+
+        uint64_t lba;
+        int count;
+
+        if(ext)
+        {
+            lba = lba_low[0] | lba_mid[0] << 8 | lba_high[0] << 16 | uint64_t(lba_low[1]) << 24 | uint64_t(lba_mid[1]) << 32 | uint64_t(lba_high[1]) << 40;
+            count = sector_count[0] | sector_count[1] << 8;
+            if(!count)
+                count = 65536;
+        }
+        else
+        {
+            lba = lba_low[0] | lba_mid[0] << 8 | lba_high[0] << 16 | (device & 0xF) << 24;
+            count = sector_count[0];
+            if(!count)
+                count = 256;
+        }
+
+        if(lba + count > num_sectors)
+        {
+            set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+            busy_error = Error_IDNF | Error_ABRT;
+            return;
+        }
+
+        command_lba = lba;
+        sectors_left = count;
+        this->block_sectors = dma ? count : block_sectors;
+
+        auto now = time_us_64();
+
+        if(dma)
+        {
+            // writes seek after receiving the data
+            if(write)
+            {
+                write_access_time = get_access_time(lba, count) - timing.command_time;
+                set_busy(now + timing.command_time, BusyAction::StartDMA);
+            }
+            else
+                set_busy(now + get_access_time(lba, count) + get_media_time(count * sector_size), BusyAction::StartDMA);
+        }
+        else if(write)
+        {
+            // the data is needed first, the seek time is added to the first block
+            first_block = true;
+            set_busy(now + timing.command_time, BusyAction::WriteBlock);
+        }
+        else
+        {
+            int first_block_time = get_media_time(std::min(count, block_sectors) * sector_size);
+            set_busy(now + get_access_time(lba, count) + first_block_time, BusyAction::ReadBlock);
+        }
+    }
+
+    void Drive::queue_command(bool write, bool ext)
+    {
+        int tag = sector_count[0] >> 3;
+        uint64_t lba;
+        int count;
+
+        // the count is in the features register
+        if(ext)
+        {
+            lba = lba_low[0] | lba_mid[0] << 8 | lba_high[0] << 16 | uint64_t(lba_low[1]) << 24 | uint64_t(lba_mid[1]) << 32 | uint64_t(lba_high[1]) << 40;
+            count = features[0] | features[1] << 8;
+            if(!count)
+                count = 65536;
+        }
+        else
+        {
+            lba = lba_low[0] | lba_mid[0] << 8 | lba_high[0] << 16 | (device & 0xF) << 24;
+            count = features[0];
+            if(!count)
+                count = 256;
+        }
+
+        // a tag that's already in use aborts everything
+        if(atapi || tag >= max_queue_depth || queue[tag].active || lba + count > num_sectors)
+        {
+            clear_queue();
+            abort();
+            return;
+        }
+
+        queue[tag] = {true, write, lba, count};
+        num_queued++;
+
+        set_busy(time_us_64() + timing.command_time, BusyAction::Release);
+    }
+
+    void Drive::service()
+    {
+        if(!service_ready)
+        {
+            abort();
+            return;
+        }
+
+        auto &cmd = queue[media_tag];
+
+        data_tag = media_tag;
+        media_tag = -1;
+        service_ready = false;
+
+        command_lba = cmd.lba;
+        sectors_left = cmd.count;
+        block_sectors = cmd.count;
+
+        // writes seek after receiving the data
+        if(cmd.write)
+            write_access_time = get_access_time(cmd.lba, cmd.count) - timing.command_time;
+
+        sector_count[0] = data_tag << 3 | (cmd.write ? 0 : Reason_IO);
+
+        set_busy(time_us_64() + timing.command_time, BusyAction::StartDMA);
+    }
+
+    // works on one queued command at a time, the closest to the head
+    void Drive::update_queue()
+    {
+        auto now = time_us_64();
+
+        if(media_tag == -1 && data_tag == -1 && num_queued)
+        {
+            uint64_t best_distance = ~0ull;
+
+            for(int tag = 0; tag < max_queue_depth; tag++)
+            {
+                if(!queue[tag].active)
+                    continue;
+
+                uint64_t distance = queue[tag].lba > next_lba ? queue[tag].lba - next_lba : next_lba - queue[tag].lba;
+                if(distance < best_distance)
+                {
+                    best_distance = distance;
+                    media_tag = tag;
+                }
+            }
+
+            auto &cmd = queue[media_tag];
+
+            if(cmd.write)
+                media_ready_time = now;
+            else
+                media_ready_time = now + get_access_time(cmd.lba, cmd.count) - timing.command_time + get_media_time(cmd.count * sector_size);
+        }
+
+        if(media_tag != -1 && !service_ready && now >= media_ready_time)
+        {
+            service_ready = true;
+
+            if(state == State::Ready)
+                status |= Status_SERV;
+
+            if(service_interrupt)
+                interrupt_pending = true;
+        }
+    }
+
+    void Drive::clear_queue()
+    {
+        for(auto &cmd : queue)
+            cmd.active = false;
+
+        num_queued = 0;
+        media_tag = data_tag = -1;
+        service_ready = false;
+    }
+
+    void Drive::read_block()
+    {
+        int block = std::min(sectors_left, block_sectors);
+
+        // IDENTIFY is a single block without a command lba
+        if(block)
+        {
+            buffer.resize(block * sector_size / 2);
+
+            if(!read_sectors(command_lba, block, buffer.data()))
+            {
+                complete(Error_UNC);
+                return;
+            }
+
+            command_lba += block;
+            sectors_left -= block;
+        }
+
+        buffer_pos = 0;
+        buffer_len = buffer.size();
+
+        state = State::DataIn;
+        status = get_ready_status() | Status_DRQ;
+        interrupt_pending = true;
+    }
+
+    void Drive::finish_write_block(uint64_t end_time)
+    {
+        int block = buffer_len * 2 / sector_size;
+
+        if(!write_sectors(command_lba, block, buffer.data()))
+        {
+            complete(Error_UNC);
+            return;
+        }
+
+        // the seek happens after the first block is received
+        uint64_t time = get_media_time(block * sector_size);
+        if(command_lba != next_lba)
+            time += get_access_time(command_lba, sectors_left) - timing.command_time;
+
+        command_lba += block;
+        sectors_left -= block;
+        next_lba = command_lba;
+
+        set_busy(end_time + time, sectors_left ? BusyAction::WriteBlock : BusyAction::Complete);
+    }
+
+    void Drive::identify(bool packet)
+    {
+        buffer.assign(256, 0);
+        auto data = buffer.data();
+
+        char serial[21];
+        snprintf(serial, sizeof(serial), "SIM%08X", unsigned(num_sectors) ^ (index << 28));
+
+        set_string(data + 10, serial, 20);
+        set_string(data + 23, "0.1", 8);
+        set_string(data + 27, packet ? "pico-ata simulated CD-ROM" : "pico-ata simulated disk", 40);
+
+        if(packet)
+        {
+            data[0] = 2 << 14 | 5 << 8 /*CD-ROM*/ | 1 << 7 /*removable*/ | 2 << 5 /*DRQ in 50us*/;
+            data[49] = 1 << 9 /*LBA*/ | 1 << 11 /*IORDY*/;
+            data[53] = 1 << 1;
+            data[82] = 1 << 4 /*PACKET*/ | 1 << 9 /*DEVICE RESET*/;
+            data[83] = 1 << 14;
+        }
+        else
+        {
+            uint64_t lba28_sectors = std::min(num_sectors, uint64_t(0x0FFFFFFF));
+
+            data[0] = 1 << 6; // fixed
+            data[1] = 16383;
+            data[3] = 16;
+            data[6] = 63;
+            data[47] = 0x8000 | max_multiple_sectors;
+            data[49] = 1 << 8 /*DMA*/ | 1 << 9 /*LBA*/ | 1 << 11 /*IORDY*/;
+            data[53] = 1 << 0 | 1 << 1 | 1 << 2;
+            data[59] = multiple_sectors ? 1 << 8 | multiple_sectors : 0;
+            data[60] = lba28_sectors & 0xFFFF;
+            data[61] = lba28_sectors >> 16;
+            data[63] = 0x7; // MWDMA 0-2
+            data[75] = max_queue_depth - 1;
+            data[82] = 1 << 5 /*write cache*/ | 1 << 8 /*SERVICE interrupt*/ | 1 << 14 /*NOP*/;
+            data[83] = 1 << 14 | 1 << 1 /*READ/WRITE DMA QUEUED*/ | 1 << 10 /*48-bit*/ | 1 << 12 /*FLUSH CACHE*/ | 1 << 13 /*FLUSH CACHE EXT*/;
+            data[84] = 1 << 14;
+            data[85] = data[82];
+            data[86] = data[83] & ~(1 << 14);
+            data[87] = 1 << 14;
+            data[88] = 0x3F; // UDMA 0-5
+            data[93] = 1 << 14 | 1 << 13; // 80-conductor cable
+            data[100] = num_sectors & 0xFFFF;
+            data[101] = (num_sectors >> 16) & 0xFFFF;
+            data[102] = (num_sectors >> 32) & 0xFFFF;
+            data[103] = num_sectors >> 48;
+        }
+
+        // PIO 3-4, 120ns cycle
+        data[64] = 0x3;
+        data[65] = data[66] = data[67] = data[68] = 120;
+        data[80] = 0x7E; // ATA-1 to ATA-6
+
+        // the checksum makes all the bytes add up to 0
+        data[255] = 0xA5;
+        uint8_t sum = 0;
+        for(int i = 0; i < 256; i++)
+            sum += (data[i] & 0xFF) + (data[i] >> 8);
+
+        data[255] |= uint8_t(-sum) << 8;
+
+        packet_device_ready = packet_device_ready || packet;
+    }
+
+    void Drive::execute_packet()
+    {
+        auto command = static_cast<SCSICommand>(packet[0]);
+
+        buffer.clear();
+        sectors_left = 0;
+
+        // the first command after a reset (other than INQUIRY) reports it
+        if(unit_attention && command != SCSICommand::INQUIRY)
+        {
+            unit_attention = false;
+            set_sense(int(SCSISenseKey::UNIT_ATTENTION), 0x29); // power on/reset
+
+            if(command != SCSICommand::REQUEST_SENSE)
+            {
+                packet_check_condition();
+                return;
+            }
+        }
+
+        auto now = time_us_64();
+
+        switch(command)
+        {
+            case SCSICommand::TEST_UNIT_READY:
+                set_sense(0, 0);
+                sector_count[0] = Reason_CoD | Reason_IO;
+                set_busy(now + timing.command_time, BusyAction::Complete);
+                return;
+
+            case SCSICommand::REQUEST_SENSE:
+            {
+                uint8_t sense[18]{};
+                sense[0] = 0x70; // current, fixed format
+                sense[2] = sense_key;
+                sense[7] = 10;
+                sense[12] = sense_asc;
+
+                int len = std::min(int(sizeof(sense)), int(packet[4]));
+                buffer.resize((len + 1) / 2);
+                memcpy(buffer.data(), sense, len);
+
+                set_sense(0, 0);
+                start_packet_data(len);
+                return;
+            }
+
+            case SCSICommand::INQUIRY:
+            {
+                uint8_t inquiry[36]{};
+                inquiry[0] = 0x05; // CD/DVD
+                inquiry[1] = 0x80; // removable
+                inquiry[3] = 0x02; // response format
+                inquiry[4] = sizeof(inquiry) - 5;
+                memcpy(inquiry + 8, "PICO-ATA", 8);
+                memcpy(inquiry + 16, "SIMULATED CD-ROM", 16);
+                memcpy(inquiry + 32, "0.1 ", 4);
+
+                int len = std::min(int(sizeof(inquiry)), packet[3] << 8 | packet[4]);
+                buffer.resize((len + 1) / 2);
+                memcpy(buffer.data(), inquiry, len);
+
+                start_packet_data(len);
+                return;
+            }
+
+            case SCSICommand::READ_CAPACITY_10:
+            {
+                uint32_t last_lba = num_sectors - 1;
+                uint8_t capacity[8]{
+                    uint8_t(last_lba >> 24), uint8_t(last_lba >> 16), uint8_t(last_lba >> 8), uint8_t(last_lba),
+                    0, 0, uint8_t(sector_size >> 8), uint8_t(sector_size)
+                };
+
+                buffer.resize(4);
+                memcpy(buffer.data(), capacity, sizeof(capacity));
+
+                start_packet_data(sizeof(capacity));
+                return;
+            }
+
+            case SCSICommand::READ_10:
+            case SCSICommand::READ_12:
+            {
+                uint32_t lba = packet[2] << 24 | packet[3] << 16 | packet[4] << 8 | packet[5];
+                uint32_t count = command == SCSICommand::READ_12
+                               ? packet[6] << 24 | packet[7] << 16 | packet[8] << 8 | packet[9]
+                               : packet[7] << 8 | packet[8];
+
+                if(lba + count > num_sectors)
+                {
+                    set_sense(int(SCSISenseKey::ILLEGAL_REQUEST), 0x21); // LBA out of range
+                    packet_check_condition();
+                    return;
+                }
+
+                if(!count)
+                {
+                    sector_count[0] = Reason_CoD | Reason_IO;
+                    set_busy(now + timing.command_time, BusyAction::Complete);
+                    return;
+                }
+
+                command_lba = lba;
+                sectors_left = count;
+                packet_bytes_left = count * sector_size;
+
+                int first_chunk = std::min(packet_bytes_left, byte_count_limit);
+                set_busy(now + get_access_time(lba, count) + get_media_time(first_chunk), BusyAction::PacketData);
+                return;
+            }
+
+            default:
+                set_sense(int(SCSISenseKey::ILLEGAL_REQUEST), 0x20); // invalid command
+                packet_check_condition();
+                return;
+        }
+    }
+
+    // data from the buffer
+    void Drive::start_packet_data(int bytes)
+    {
+        packet_bytes_left = bytes;
+        buffer_pos = 0;
+        set_busy(time_us_64() + timing.command_time, BusyAction::PacketData);
+    }
+
+    // the next DRQ block, up to the byte count limit
+    void Drive::packet_data_block()
+    {
+        int bytes = std::min(packet_bytes_left, byte_count_limit);
+
+        if(sectors_left)
+        {
+            // whole sectors if they fit
+            if(bytes >= sector_size)
+                bytes -= bytes % sector_size;
+
+            // a partial sector is only possible with a tiny limit, the rest of it is sent in the next block
+            int offset = (packet_bytes_left % sector_size) ? sector_size - packet_bytes_left % sector_size : 0;
+
+            int sectors = (offset + bytes + sector_size - 1) / sector_size;
+            std::vector<uint16_t> sector_buf(sectors * sector_size / 2);
+
+            if(!read_sectors(command_lba, sectors, sector_buf.data()))
+            {
+                set_sense(int(SCSISenseKey::MEDIUM_ERROR), 0x11); // unrecovered read error
+                packet_check_condition();
+                return;
+            }
+
+            buffer.assign(sector_buf.begin() + offset / 2, sector_buf.begin() + (offset + bytes) / 2);
+
+            int sectors_done = (offset + bytes) / sector_size;
+            command_lba += sectors_done;
+            sectors_left -= sectors_done;
+        }
+        else
+            buffer.erase(buffer.begin(), buffer.begin() + buffer_pos);
+
+        packet_bytes_left -= bytes;
+
+        buffer_pos = 0;
+        buffer_len = (bytes + 1) / 2;
+
+        lba_mid[0] = bytes & 0xFF;
+        lba_high[0] = bytes >> 8;
+        sector_count[0] = Reason_IO;
+
+        state = State::DataIn;
+        status = Status_DRDY | Status_DRQ;
+        interrupt_pending = true;
+    }
+
+    void Drive::set_sense(int key, int asc)
+    {
+        sense_key = key;
+        sense_asc = asc;
+    }
+
+    // the error register has the sense key
+    void Drive::packet_check_condition()
+    {
+        sectors_left = 0;
+        packet_bytes_left = 0;
+        sector_count[0] = Reason_CoD | Reason_IO;
+
+        set_busy(time_us_64() + timing.command_time, BusyAction::Complete);
+        busy_error = sense_key << 4 | (sense_key == int(SCSISenseKey::ILLEGAL_REQUEST) ? Error_ABRT : 0);
+    }
+
+    bool Drive::read_sectors(uint64_t lba, int count, void *data)
+    {
+        size_t len = size_t(count) * sector_size;
+        return pread(fd, data, len, lba * sector_size) == ssize_t(len);
+    }
+
+    bool Drive::write_sectors(uint64_t lba, int count, const void *data)
+    {
+        size_t len = size_t(count) * sector_size;
+        return pwrite(fd, data, len, lba * sector_size) == ssize_t(len);
+    }
+}
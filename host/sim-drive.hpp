@@ -0,0 +1,179 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "ata.hpp"
+
+namespace ata_sim
+{
+    // latency model (us)
+    struct DriveTiming
+    {
+        int command_time;        // overhead for every command
+        int track_to_track_time; // shortest seek
+        int full_stroke_time;    // seek across the whole disk, shorter seeks scale with the square root of the distance
+        int rotation_time;       // one revolution, half of this is added to every non-sequential access
+        int media_rate;          // kB/s to/from the media
+        int reset_time;          // BSY after a reset
+    };
+
+    extern const DriveTiming hdd_timing, ssd_timing, no_timing;
+
+    // an ATA or ATAPI device backed by an image file
+    // the bus calls into this with register accesses, anything the device does later happens when it's next accessed
+    // (times are time_us_64 values)
+    class Drive final
+    {
+    public:
+        ~Drive();
+
+        bool open(const char *path, int index, bool atapi);
+        bool is_open() const {return fd != -1;}
+
+        void set_timing(const DriveTiming &timing) {this->timing = timing;}
+
+        // RESET- or SRST
+        void reset();
+
+        // taskfile writes go to both devices, the Command register is only written to the selected one
+        void write_register(ata::ATAReg reg, uint8_t data);
+        uint8_t read_register(ata::ATAReg reg);
+
+        // PIO data, the transfer ends at end_time
+        int read_data(uint16_t *data, int count, uint64_t end_time);
+        int write_data(const uint16_t *data, int count, uint64_t end_time);
+
+        // DMA data, the whole transfer is done in one go
+        bool is_dma_requested();
+        int transfer_dma(uint16_t *read_data, const uint16_t *write_data, int count, uint64_t end_time);
+
+        bool get_interrupt();
+
+        // when the device will next change state on its own, 0 if it won't
+        uint64_t get_next_event_time() const;
+
+    private:
+        enum class State
+        {
+            Ready,
+            Busy,
+            DataIn,  // DRQ, host reading buffer
+            DataOut, // DRQ, host writing buffer
+            DMA,
+            Packet,  // DRQ, host writing the command packet
+        };
+
+        // what happens when BSY is cleared
+        enum class BusyAction
+        {
+            Complete,
+            ReadBlock,
+            WriteBlock,
+            StartDMA,
+            RequestPacket,
+            PacketData,
+            Release, // queued command accepted
+        };
+
+        // READ/WRITE DMA QUEUED
+        struct QueuedCommand
+        {
+            bool active = false;
+            bool write;
+            uint64_t lba;
+            int count;
+        };
+
+        void update();
+        void set_busy(uint64_t until, BusyAction action);
+        void end_busy();
+
+        void complete(uint8_t error = 0);
+        void abort();
+
+        // DRDY and DSC, or SERV while there are queued commands
+        uint8_t get_ready_status() const;
+
+        bool is_selected() const {return ((device >> 4) & 1) == index;}
+        void set_signature();
+
+        uint64_t get_access_time(uint64_t lba, int count);
+        int get_media_time(int bytes) const;
+
+        void execute_command(ata::ATACommand command);
+        void start_sector_command(bool write, bool dma, bool ext, int block_sectors);
+        void read_block();
+        void finish_write_block(uint64_t end_time);
+
+        void queue_command(bool write, bool ext);
+        void service();
+        void update_queue();
+        void clear_queue();
+
+        void identify(bool packet);
+
+        // ATAPI
+        void execute_packet();
+        void start_packet_data(int bytes);
+        void packet_data_block();
+        void set_sense(int key, int asc);
+        void packet_check_condition();
+
+        bool read_sectors(uint64_t lba, int count, void *data);
+        bool write_sectors(uint64_t lba, int count, const void *data);
+
+        int fd = -1;
+        int index = 0;
+        bool atapi = false;
+        int sector_size = 512;
+        uint64_t num_sectors = 0;
+
+        DriveTiming timing = hdd_timing;
+
+        // registers, with the previous value for 48-bit commands
+        uint8_t features[2]{}, sector_count[2]{}, lba_low[2]{}, lba_mid[2]{}, lba_high[2]{};
+        uint8_t device = 0, device_control = 0;
+        uint8_t status = 0, error = 0;
+
+        bool interrupt_pending = false;
+        bool packet_device_ready = false; // DRDY is clear until IDENTIFY PACKET DEVICE
+
+        State state = State::Ready;
+        uint64_t busy_until = 0;
+        BusyAction busy_action = BusyAction::Complete;
+        uint8_t busy_error = 0;
+
+        // data transfer
+        std::vector<uint16_t> buffer;
+        int buffer_pos = 0, buffer_len = 0;
+
+        uint64_t command_lba = 0;
+        int sectors_left = 0;
+        int block_sectors = 1;
+        bool first_block = false;
+
+        int multiple_sectors = 0;
+        static const int max_multiple_sectors = 16;
+
+        // sequential accesses don't seek
+        uint64_t next_lba = 0;
+        uint64_t write_access_time = 0;
+
+        // queued commands, the device releases the bus and works on the closest one first
+        static const int max_queue_depth = 32;
+        QueuedCommand queue[max_queue_depth];
+        int num_queued = 0;
+        int media_tag = -1; // seeking/reading
+        uint64_t media_ready_time = 0;
+        bool service_ready = false; // SERV, media_tag is ready for the data
+        int data_tag = -1; // after SERVICE
+        bool service_interrupt = false;
+
+        // ATAPI
+        uint8_t packet[12];
+        int byte_count_limit = 0;
+        int packet_bytes_left = 0;
+        int sense_key = 0, sense_asc = 0;
+        bool unit_attention = false;
+    };
+}
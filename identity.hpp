@@ -76,7 +76,7 @@ namespace ata
         bool rw_multiple_sector_setting_valid() const {return data[59] & (1 << 8);}
         uint8_t current_read_write_multiple() const {return data[59] & 0xFF;}
 
-        uint32_t total_user_addressable_sectors() const {return data[60] | data[61] << 16;}
+        uint32_t total_user_addressable_sectors() const {return data[60] | uint32_t(data[61]) << 16;}
 
         // ATA-2
         // 62 is single word DMA modes (obsolete in ATA-3)
@@ -112,13 +112,14 @@ namespace ata
         // ATA-5
         // 92 is master password revision code
         // 93 is hardware test results
+        bool cable_80_conductor_detected() const {return (data[93] >> 14) == 1 && (data[93] & (1 << 13));}
         // 160 is CFA power mode 1
         bool checksum_valid() const {return (data[255] & 0xFF) == 0xA5;}
         uint8_t get_checksum() const {return data[255] >> 8;}
 
         // ATA-6
         // 94 is acoustic management
-        // 100-103 is max LBA for 48bit
+        uint64_t total_user_addressable_sectors_48bit() const {return uint64_t(data[100]) | uint64_t(data[101]) << 16 | uint64_t(data[102]) << 32 | uint64_t(data[103]) << 48;}
         // 176-205 is media serial number
 
         // command sets
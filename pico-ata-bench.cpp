@@ -0,0 +1,404 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include "pico/stdlib.h"
+#include "pico/time.h"
+
+#include "ata.hpp"
+#include "device-profile.hpp"
+
+// benchmark firmware, reads commands from stdio and prints results as CSV
+// (anything that isn't a result row starts with #)
+//
+// commands:
+//   bench <device> <seq|rand> <read|write|mix[:read percent]> <sectors> <span> <seconds> [queue depth]
+//     span is the number of sectors from LBA 0 to use, 0 for the whole device
+//     with a queue depth above 1 the commands are submitted asynchronously, so ata can reorder and merge them
+//   mode <device> <pio|mwdma|udma> <mode>
+//   queue <device> <depth>
+//     READ/WRITE DMA QUEUED depth if the device supports it, 0 disables (the device reorders the queued commands itself)
+//   writes <on|off>
+//     write/mix workloads overwrite data on the device, so they are refused until enabled
+
+static const int max_transfer_sectors = 256;
+static const int max_queue_depth = 8; // commands ata can have pending
+static uint16_t buf[max_transfer_sectors * 256];
+
+static ata::DeviceProfile profiles[2];
+static bool writes_enabled = false;
+
+// latency histogram, exact up to 128us then 64 buckets per power of two (< 1.6% error)
+class LatencyHistogram final
+{
+public:
+    void clear()
+    {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        max = 0;
+    }
+
+    void add(uint32_t us)
+    {
+        counts[get_index(us)]++;
+        total++;
+        max = std::max(max, us);
+    }
+
+    // returns the upper bound of the bucket containing the percentile
+    uint32_t get_percentile(int percent) const
+    {
+        if(!total)
+            return 0;
+
+        uint64_t target = (uint64_t(total) * percent + 99) / 100;
+        uint64_t count = 0;
+
+        for(int i = 0; i < num_buckets; i++)
+        {
+            count += counts[i];
+            if(count >= target)
+                return std::min(get_upper_bound(i), max);
+        }
+
+        return max;
+    }
+
+    uint32_t get_max() const {return max;}
+
+private:
+    static const int sub_buckets = 64;
+    static const int num_buckets = sub_buckets * 2 + 25 * sub_buckets; // up to 2^32us
+
+    static int get_index(uint32_t us)
+    {
+        if(us < sub_buckets * 2)
+            return us;
+
+        int shift = (31 - __builtin_clz(us)) - 6;
+        return sub_buckets * 2 + (shift - 1) * sub_buckets + (us >> shift) - sub_buckets;
+    }
+
+    static uint32_t get_upper_bound(int index)
+    {
+        if(index < sub_buckets * 2)
+            return index;
+
+        int shift = (index - sub_buckets * 2) / sub_buckets + 1;
+        uint32_t base = (index - sub_buckets * 2) % sub_buckets + sub_buckets;
+
+        return ((base + 1) << shift) - 1;
+    }
+
+    uint32_t counts[num_buckets];
+    uint32_t total = 0;
+    uint32_t max = 0;
+};
+
+static LatencyHistogram histogram;
+
+static const char *get_mode_name(int device)
+{
+    static const char *const mode_names[]{"pio", "mwdma", "udma"};
+    return mode_names[static_cast<int>(ata::get_transfer_mode(device))];
+}
+
+static void print_csv_header()
+{
+    printf("device,mode,pattern,op,read_percent,sectors,span,queue_depth,duration_us,ops,errors,bytes,mb_s,p50_us,p99_us,max_us\n");
+}
+
+static void run_benchmark(int device, bool random, int read_percent, int num_sectors, uint64_t span, int seconds, int queue_depth)
+{
+    auto &profile = profiles[device];
+
+    if(!span || span > profile.num_sectors)
+        span = profile.num_sectors;
+
+    if(span < uint64_t(num_sectors))
+    {
+        printf("# span too small\n");
+        return;
+    }
+
+    // fixed seed so runs are repeatable
+    std::mt19937 gen;
+    std::uniform_int_distribution<uint64_t> lba_distrib(0, (span - num_sectors) / num_sectors);
+    std::uniform_int_distribution<> op_distrib(0, 99);
+
+    for(int i = 0; i < max_transfer_sectors * 256; i++)
+        buf[i] = i;
+
+    histogram.clear();
+
+    // each slot gets its own part of the buffer if they all fit, so sequential commands can be merged
+    ata::CommandHandle handles[max_queue_depth];
+    uint64_t op_starts[max_queue_depth];
+    int slot_words = num_sectors * queue_depth <= max_transfer_sectors ? num_sectors * 256 : 0;
+    int in_flight = 0;
+
+    std::fill(handles, handles + queue_depth, -1);
+
+    uint64_t next_lba = 0;
+    uint32_t ops = 0, errors = 0;
+
+    auto start = time_us_64();
+    auto end_time = start + uint64_t(seconds) * 1000000;
+    uint64_t now = start;
+
+    while(now < end_time || in_flight)
+    {
+        // keep the queue full until the time is up
+        for(int slot = 0; slot < queue_depth && now < end_time; slot++)
+        {
+            if(handles[slot] != -1)
+                continue;
+
+            uint64_t lba;
+            if(random)
+                lba = lba_distrib(gen) * num_sectors;
+            else
+            {
+                if(next_lba + num_sectors > span)
+                    next_lba = 0;
+
+                lba = next_lba;
+                next_lba += num_sectors;
+            }
+
+            bool read = op_distrib(gen) < read_percent;
+            auto data = buf + slot * slot_words;
+
+            op_starts[slot] = time_us_64();
+            handles[slot] = read ? ata::submit_read_sectors(device, lba, num_sectors, data) : ata::submit_write_sectors(device, lba, num_sectors, data);
+            in_flight++;
+        }
+
+        ata::update_commands();
+
+        now = time_us_64();
+
+        for(int slot = 0; slot < queue_depth; slot++)
+        {
+            if(handles[slot] == -1 || !ata::is_command_done(handles[slot]))
+                continue;
+
+            int result = ata::complete_command(handles[slot]);
+
+            histogram.add(now - op_starts[slot]);
+            ops++;
+
+            if(result != num_sectors)
+                errors++;
+
+            handles[slot] = -1;
+            in_flight--;
+        }
+    }
+
+    // make sure everything written is included
+    if(read_percent < 100)
+        ata::flush_cache(device);
+
+    auto duration_us = time_us_64() - start;
+    uint64_t bytes = uint64_t(ops - errors) * num_sectors * 512;
+    float mb_s = float(bytes) / duration_us; // bytes/us == MB/s
+
+    const char *op = read_percent == 100 ? "read" : (read_percent == 0 ? "write" : "mix");
+
+    printf("%i,%s%i,%s,%s,%i,%i,%" PRIu64 ",%i,%" PRIu64 ",%" PRIu32 ",%" PRIu32 ",%" PRIu64 ",%.3f,%" PRIu32 ",%" PRIu32 ",%" PRIu32 "\n",
+        device, get_mode_name(device), ata::get_transfer_mode_num(device), random ? "rand" : "seq", op, read_percent,
+        num_sectors, span, queue_depth, duration_us, ops, errors, bytes, mb_s,
+        histogram.get_percentile(50), histogram.get_percentile(99), histogram.get_max()
+    );
+}
+
+static void set_mode(int device, const char *mode, int mode_num)
+{
+    // PIO cycle times for modes 0-4
+    static const int pio_cycle_time[]{600, 383, 240, 180, 120};
+
+    auto &profile = profiles[device];
+    bool ok = false;
+
+    if(strcmp(mode, "pio") == 0 && mode_num >= 0 && mode_num <= profile.max_pio_mode)
+    {
+        ok = ata::set_transfer_mode(device, ata::TransferMode::PIO, mode_num);
+        if(ok)
+            ata::adjust_for_min_cycle_time(device, std::max(pio_cycle_time[mode_num], profile.min_pio_cycle_time));
+    }
+    else if(strcmp(mode, "mwdma") == 0 && mode_num >= 0 && mode_num <= 2 && (profile.multiword_dma_modes & (1 << mode_num)))
+        ok = ata::set_transfer_mode(device, ata::TransferMode::MultiwordDMA, mode_num);
+    else if(strcmp(mode, "udma") == 0 && mode_num >= 0 && mode_num <= ata::get_max_ultra_dma_mode() && (profile.ultra_dma_modes & (1 << mode_num)))
+        ok = ata::set_transfer_mode(device, ata::TransferMode::UltraDMA, mode_num);
+
+    if(ok)
+        printf("# device %i using %s%i\n", device, get_mode_name(device), ata::get_transfer_mode_num(device));
+    else
+        printf("# mode not supported\n");
+}
+
+static bool parse_op(const char *op, int &read_percent)
+{
+    if(strcmp(op, "read") == 0)
+        read_percent = 100;
+    else if(strcmp(op, "write") == 0)
+        read_percent = 0;
+    else if(strncmp(op, "mix", 3) == 0)
+        read_percent = op[3] == ':' ? atoi(op + 4) : 50;
+    else
+        return false;
+
+    return read_percent >= 0 && read_percent <= 100;
+}
+
+static void handle_command(char *line)
+{
+    char *args[8];
+    int num_args = 0;
+
+    for(char *tok = strtok(line, " \t"); tok && num_args < 8; tok = strtok(nullptr, " \t"))
+        args[num_args++] = tok;
+
+    if(!num_args)
+        return;
+
+    int device = num_args > 1 ? atoi(args[1]) : -1;
+    bool device_valid = device == 0 || device == 1 ? profiles[device].valid && !profiles[device].is_atapi : false;
+
+    if(strcmp(args[0], "bench") == 0 && (num_args == 7 || num_args == 8))
+    {
+        int read_percent;
+        int num_sectors = atoi(args[4]);
+        int seconds = atoi(args[6]);
+        int queue_depth = num_args == 8 ? atoi(args[7]) : 1;
+
+        if(!device_valid)
+            printf("# no ATA device %s\n", args[1]);
+        else if(strcmp(args[2], "seq") != 0 && strcmp(args[2], "rand") != 0)
+            printf("# bad pattern %s\n", args[2]);
+        else if(!parse_op(args[3], read_percent))
+            printf("# bad op %s\n", args[3]);
+        else if(read_percent < 100 && !writes_enabled)
+            printf("# writes are disabled\n");
+        else if(num_sectors < 1 || num_sectors > max_transfer_sectors)
+            printf("# sectors must be 1-%i\n", max_transfer_sectors);
+        else if(seconds < 1)
+            printf("# bad duration\n");
+        else if(queue_depth < 1 || queue_depth > max_queue_depth)
+            printf("# queue depth must be 1-%i\n", max_queue_depth);
+        else
+            run_benchmark(device, args[2][0] == 'r', read_percent, num_sectors, strtoull(args[5], nullptr, 0), seconds, queue_depth);
+    }
+    else if(strcmp(args[0], "mode") == 0 && num_args == 4)
+    {
+        if(device_valid)
+            set_mode(device, args[2], atoi(args[3]));
+        else
+            printf("# no ATA device %s\n", args[1]);
+    }
+    else if(strcmp(args[0], "queue") == 0 && num_args == 3)
+    {
+        int depth = atoi(args[2]);
+
+        if(!device_valid)
+            printf("# no ATA device %s\n", args[1]);
+        else if(depth < 0 || depth > profiles[device].queue_depth)
+            printf("# queue depth must be 0-%i\n", profiles[device].queue_depth);
+        else
+        {
+            ata::set_queue_depth(device, depth);
+            printf("# device %i queue depth %i\n", device, ata::get_queue_depth(device));
+        }
+    }
+    else if(strcmp(args[0], "writes") == 0 && num_args == 2)
+    {
+        writes_enabled = strcmp(args[1], "on") == 0;
+        printf("# writes %s\n", writes_enabled ? "enabled" : "disabled");
+    }
+    else if(strcmp(args[0], "header") == 0)
+        print_csv_header();
+    else
+        printf("# unknown command\n");
+}
+
+static void detect_devices()
+{
+    // reset timings for init
+    ata::adjust_for_min_cycle_time(600);
+
+    for(int i = 0; i < 2; i++)
+    {
+        auto &profile = profiles[i];
+
+        // ATAPI devices are detected, but not benchmarked
+        // DEVICE RESET sets the signature, ATA devices abort it
+        bool is_atapi = false;
+
+        if(ata::device_reset(i))
+        {
+            uint8_t lba_mid = ata::read_register(ata::ATAReg::LBAMid);
+            uint8_t lba_high = ata::read_register(ata::ATAReg::LBAHigh);
+            is_atapi = lba_mid == 0x14 && lba_high == 0xEB;
+        }
+
+        if(!ata::read_device_profile(i, profile, is_atapi ? ata::ATACommand::IDENTIFY_PACKET_DEVICE : ata::ATACommand::IDENTIFY_DEVICE))
+            continue;
+
+        if(!is_atapi)
+            ata::setup_transfer_modes(i, profile);
+        else
+            ata::adjust_for_min_cycle_time(i, profile.min_pio_cycle_time);
+
+        printf("# device %i: %s%s, %" PRIu64 " sectors, %s%i, queue depth %i\n", i, profile.model, is_atapi ? " (ATAPI)" : "", profile.num_sectors, get_mode_name(i), ata::get_transfer_mode_num(i), ata::get_queue_depth(i));
+    }
+}
+
+int main()
+{
+    ata::init_io();
+
+    stdio_init_all();
+
+    printf("# starting...\n");
+
+    ata::do_reset();
+
+    detect_devices();
+
+    print_csv_header();
+
+    char line[128];
+    int line_len = 0;
+
+    while(true)
+    {
+        int c = getchar();
+
+#if !PICO_ON_DEVICE
+        // end of input, commands can be piped in on the host build
+        if(c == EOF)
+        {
+            line[line_len] = 0;
+            if(line_len)
+                handle_command(line);
+            break;
+        }
+#endif
+
+        if(c == '\r' || c == '\n')
+        {
+            line[line_len] = 0;
+            line_len = 0;
+            handle_command(line);
+        }
+        else if(c >= 0 && line_len < int(sizeof(line)) - 1)
+            line[line_len++] = c;
+    }
+
+    return 0;
+}
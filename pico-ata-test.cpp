@@ -10,6 +10,7 @@
 
 #include "ata.hpp"
 #include "atapi.hpp"
+#include "device-profile.hpp"
 #include "identity.hpp"
 
 static void print_identify_result(uint16_t data[256])
@@ -131,6 +132,8 @@ static void print_identify_result(uint16_t data[256])
         if(parser.rw_multiple_sector_setting_valid())
             printf("\tcur num sectors for multi: %i\n", parser.current_read_write_multiple());
         printf("\t%lu user addressable sectors\n", parser.total_user_addressable_sectors());
+        if(parser.address_48bit_supported())
+            printf("\t%llu user addressable sectors (48-bit)\n", parser.total_user_addressable_sectors_48bit());
 
         // 62 is single word dma modes
     }
@@ -569,28 +572,18 @@ static void test_ata(int device)
 
     print_identify_result(data);
 
-    IdentityParser parser(data);
+    DeviceProfile profile;
+    parse_device_profile(data, profile);
 
-    // set PIO mode if >= 3
-    if(parser.timing_params_valid() && parser.advanced_pio_modes_supported())
-    {
-        int mode = (parser.advanced_pio_modes_supported() & (1 << 1)) ? 4 : 3;
-        ata::set_features(device, ata::ATAFeature::SetTransferMode, 1 << 3/*PIO flow control mode*/ | mode);
-    }
+    printf("adjusting for %ins cycle time\n", profile.min_pio_cycle_time);
 
-    // reconfigure for speed
-    int min_cycle_time = 600;
-    if(parser.timing_params_valid())
-        min_cycle_time = parser.min_pio_cycle_time_iordy();
+    setup_transfer_modes(device, profile);
 
-    // we're wrong for reg access in modes 1-2 (330-383ns cycle times)
-    // (and the mode 2 cycle time for reg access is different...)
-    // let's just hope nobody connects a drive that slow
+    printf("r/w multiple: %i\n", get_multiple_mode(device));
 
-    printf("adjusting for %ins cycle time\n", min_cycle_time);
+    static const char *const mode_names[]{"PIO", "multiword DMA", "Ultra DMA"};
+    printf("using %s mode %i\n", mode_names[static_cast<int>(get_transfer_mode(device))], get_transfer_mode_num(device));
 
-    ata::adjust_for_min_cycle_time(min_cycle_time);
-   
     // okay, lets try to read the MBR
     ata::read_sectors(device, 0, 1, data);
 
@@ -660,6 +653,9 @@ static void test_ata(int device)
     
     printf("\nread %ix1 random sectors in %llius %3.3f%s/s", count, time_us, speed, unit);
 
+    if(ata::get_transfer_mode(device) == ata::TransferMode::UltraDMA)
+        printf("\nUDMA CRC errors: %u (now mode %i)", ata::get_udma_crc_error_count(), ata::get_transfer_mode_num(device));
+
     printf("\n");
 }
 
@@ -751,11 +747,11 @@ int main()
     auto reset_time = absolute_time_diff_us(start, end);
     printf("Device reset done in %llius\n", reset_time);
 
+    // reset timings for init
+    ata::adjust_for_min_cycle_time(600);
+
     for(int i = 0; i < 2; i++)
     {
-        // reset timings for init
-        ata::adjust_for_min_cycle_time(600);
-
         bool is_atapi = false;
         
         // attempt a DEVICE RESET to set the signature
@@ -2,9 +2,12 @@
 
 enum class SCSICommand
 {
-    TEST_UNIT_READY = 0x00,
-    INQUIRY         = 0x12,
-    READ_10         = 0x28,
+    TEST_UNIT_READY  = 0x00,
+    REQUEST_SENSE    = 0x03,
+    INQUIRY          = 0x12,
+    READ_CAPACITY_10 = 0x25,
+    READ_10          = 0x28,
+    READ_12          = 0xA8,
 };
 
 enum class SCSISenseKey
@@ -0,0 +1,192 @@
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+
+#include "ata.hpp"
+#include "atapi.hpp"
+
+#include "ata-worker.hpp"
+#include "spsc-queue.hpp"
+
+using ata_worker::Request;
+using ata_worker::RequestType;
+using ata_worker::Response;
+
+// same as the number of commands ata can have pending
+static const int max_requests = 8;
+
+static SPSCQueue<Request, max_requests> request_queue;
+static SPSCQueue<Response, max_requests> response_queue;
+
+// submitted to ata, which may reorder them
+static Request active_requests[max_requests];
+static ata::CommandHandle active_handles[max_requests];
+static int num_active = 0;
+
+static bool on_core1 = false;
+
+// packet commands are blocking
+static Response run_packet_request(const Request &request)
+{
+    Response response{request.id, 0};
+    bool ok;
+
+    switch(request.type)
+    {
+        case RequestType::PacketRead:
+            ok = atapi::read(request.device, request.lba, request.num_sectors, reinterpret_cast<uint8_t *>(request.data), request.sector_size);
+            response.result = ok ? request.num_sectors : 0;
+            break;
+
+        case RequestType::TestUnitReady:
+            ok = atapi::test_unit_ready(request.device);
+            response.result = ok ? 1 : 0;
+            break;
+
+        case RequestType::ReadCapacity:
+            ok = atapi::read_capacity(request.device, reinterpret_cast<uint8_t *>(request.data));
+            response.result = ok ? 1 : 0;
+            break;
+
+        default:
+            return response;
+    }
+
+    if(!ok)
+    {
+        // the key is in the error register, REQUEST SENSE has the rest
+        response.sense_key = int(atapi::get_sense_key());
+
+        uint8_t sense[18];
+        if(atapi::request_sense(request.device, sense, sizeof(sense)) && (sense[2] & 0xF))
+        {
+            response.sense_key = sense[2] & 0xF;
+            response.sense_asc = sense[12];
+            response.sense_ascq = sense[13];
+        }
+    }
+
+    return response;
+}
+
+static void worker_update()
+{
+    // start new commands while there's space
+    Request request;
+    while(num_active < max_requests && request_queue.peek(request))
+    {
+        bool is_packet = request.type == RequestType::PacketRead || request.type == RequestType::TestUnitReady || request.type == RequestType::ReadCapacity;
+
+        if(request.type == RequestType::Identify || request.type == RequestType::Flush || is_packet)
+        {
+            // not async commands, wait for everything before them
+            // (and don't start without somewhere to put the response)
+            if(num_active || response_queue.full())
+                break;
+
+            request_queue.pop(request);
+
+            if(is_packet)
+            {
+                response_queue.push(run_packet_request(request));
+                continue;
+            }
+
+            bool ok;
+            if(request.type == RequestType::Identify)
+                ok = ata::identify_device(request.device, request.data);
+            else
+                ok = ata::flush_cache(request.device);
+
+            response_queue.push({request.id, ok ? 1 : 0});
+            continue;
+        }
+
+        ata::CommandHandle handle;
+        if(request.type == RequestType::Read)
+            handle = ata::submit_read_sectors(request.device, request.lba, request.num_sectors, request.data);
+        else
+            handle = ata::submit_write_sectors(request.device, request.lba, request.num_sectors, request.data);
+
+        if(handle == -1)
+            break;
+
+        request_queue.pop(request);
+
+        active_requests[num_active] = request;
+        active_handles[num_active] = handle;
+        num_active++;
+    }
+
+    ata::update_commands();
+
+    for(int i = 0; i < num_active && !response_queue.full();)
+    {
+        if(!ata::is_command_done(active_handles[i]))
+        {
+            i++;
+            continue;
+        }
+
+        int result = ata::complete_command(active_handles[i]);
+        response_queue.push({active_requests[i].id, result});
+
+        num_active--;
+        for(int j = i; j < num_active; j++)
+        {
+            active_requests[j] = active_requests[j + 1];
+            active_handles[j] = active_handles[j + 1];
+        }
+    }
+}
+
+static void core1_main()
+{
+    while(true)
+    {
+        worker_update();
+
+        // nothing to do until submit wakes us up
+        // (if a request arrived after the check, the event is still set and this returns immediately)
+        if(!num_active && request_queue.empty())
+        {
+            __wfe();
+            continue;
+        }
+
+        // sleep while the drive is busy, a new request also wakes us up
+        ata::wait_for_interrupt();
+    }
+}
+
+namespace ata_worker
+{
+    void init(bool use_core1)
+    {
+        on_core1 = use_core1;
+
+        if(use_core1)
+            multicore_launch_core1(core1_main);
+    }
+
+    bool submit(const Request &request)
+    {
+        if(!request_queue.push(request))
+            return false;
+
+        // wake up core1 if it's waiting
+        __sev();
+
+        return true;
+    }
+
+    bool get_response(Response &response)
+    {
+        return response_queue.pop(response);
+    }
+
+    void update()
+    {
+        if(!on_core1)
+            worker_update();
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+
+// runs ATA commands for the USB glue, either on core1 or from the main loop
+// once started it owns the bus, so everything else should go through it
+namespace ata_worker
+{
+    enum class RequestType
+    {
+        Read,
+        Write,
+        Identify,
+        Flush,
+
+        // ATAPI
+        PacketRead,
+        TestUnitReady,
+        ReadCapacity,
+    };
+
+    struct Request
+    {
+        RequestType type;
+        int id; // returned in the response
+
+        int device;
+        uint64_t lba;
+        int num_sectors;
+        uint16_t *data; // 256 words for identify, 4 for read capacity (the raw response)
+
+        int sector_size = 512; // ATAPI media has its own block size
+    };
+
+    struct Response
+    {
+        int id;
+        int result; // sectors transferred, or 1 if identify/flush/test unit ready/read capacity succeeded
+
+        // from REQUEST SENSE if an ATAPI request failed
+        uint8_t sense_key = 0, sense_asc = 0, sense_ascq = 0;
+    };
+
+    void init(bool use_core1);
+
+    // returns false if the queue is full
+    bool submit(const Request &request);
+    bool get_response(Response &response);
+
+    // does nothing if running on core1
+    void update();
+}
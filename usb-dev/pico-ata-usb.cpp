@@ -1,16 +1,567 @@
+#include <algorithm>
+#include <type_traits>
+
+#include "hardware/clocks.h"
 #include "pico/stdlib.h"
 #include "pico/time.h"
 
 #include "tusb.h"
+#include "device/usbd_pvt.h"
+
+// for tud_msc_async_io_done
+#if TUSB_VERSION_MAJOR == 0 && TUSB_VERSION_MINOR < 18
+#error "TinyUSB 0.18 or newer is required"
+#endif
 
 #include "ata.hpp"
-#include "identity.hpp"
+#include "device-profile.hpp"
 
+#include "ata-worker.hpp"
 #include "usb-dev-config.h"
 
-// USB MSC glue
-static bool storage_ejected = false;
-static bool device_detected = false;
+// an ATA device exposed as a LUN
+struct LogicalUnit
+{
+    int device;
+
+    // read at detection, refreshed if the media is loaded again
+    ata::DeviceProfile profile;
+
+    // ATAPI devices get the capacity from READ CAPACITY, which is only valid while there's media
+    bool media_loaded = false;
+
+    uint32_t next_read_lba = ~0u; // for detecting sequential reads
+    int read_ahead_sectors = 0; // grows while the host keeps reading sequentially
+
+    bool write_failed = false; // a write nothing was waiting for failed, reported by SYNCHRONIZE CACHE
+    bool ejected = false;
+};
+
+// write buffers, the chunks of a WRITE(10) are merged in one while the other is written to the disk
+struct WriteBuffer
+{
+    enum class State
+    {
+        Free,
+        Filling,
+        Writing,
+    };
+
+    State state = State::Free;
+
+    LogicalUnit *unit;
+    uint32_t lba;
+    int num_sectors;
+
+    int transfer; // WriteTransfer id
+
+    absolute_time_t write_time; // written by this time even if not full
+
+    uint16_t data[WRITE_BACK_MAX_SECTORS * 256];
+};
+
+// the WRITE(10) being received
+// the host only sees the status after the last chunk, so the others are acknowledged once they're buffered
+// and the last one waits until all of it is on the disk (hosts treat the device as write-through)
+struct WriteTransfer
+{
+    bool active = false;
+    bool last_chunk = false; // buffered, waiting for the writes
+    bool failed = false;
+
+    int id = 0;
+    uint32_t tag; // from the CBW
+
+    uint32_t next_lba;
+    uint32_t end_lba;
+};
+
+// read-ahead cache, one segment can be read from the disk while USB is sent data from the other
+struct ReadSegment
+{
+    enum class State
+    {
+        Free,
+        Reading,
+        Ready,
+    };
+
+    State state = State::Free;
+    bool stale = false; // a write to the same sectors was submitted after the read
+
+    LogicalUnit *unit;
+    uint32_t lba;
+    int num_sectors;
+    int result; // sectors actually read
+
+    // ATAPI errors are forwarded to the host
+    uint8_t sense_key, sense_asc, sense_ascq;
+
+    uint16_t data[READ_AHEAD_MAX_SECTORS * 256];
+};
+
+static_assert(WRITE_BACK_MAX_SECTORS <= 256 && WRITE_BACK_MAX_SECTORS * 512 >= CFG_TUD_MSC_EP_BUFSIZE, "write-back should be between one USB buffer and one 28-bit command");
+static_assert(READ_AHEAD_MAX_SECTORS <= 256 && READ_AHEAD_MAX_SECTORS * 512 >= CFG_TUD_MSC_EP_BUFSIZE, "read-ahead should be between one USB buffer and one 28-bit command");
+
+// the callbacks work in whole sectors and whole USB buffers fill the write-back/read-ahead buffers exactly
+// (ATAPI media also needs the block size to divide it, that's checked when the media is loaded)
+static_assert(CFG_TUD_MSC_EP_BUFSIZE % 512 == 0, "USB buffer should be a multiple of the sector size");
+static_assert((WRITE_BACK_MAX_SECTORS * 512) % CFG_TUD_MSC_EP_BUFSIZE == 0, "USB buffer should divide the write-back buffer");
+static_assert((READ_AHEAD_MAX_SECTORS * 512) % CFG_TUD_MSC_EP_BUFSIZE == 0, "USB buffer should divide the read-ahead buffer");
+static_assert(CFG_TUD_MSC_EP_BUFSIZE <= UINT16_MAX, "tud_msc_scsi_cb has a 16-bit buffer size");
+
+static const int num_write_buffers = 2;
+static const int num_read_segments = 2;
+
+// request ids, reads are after the write buffers
+static const int sync_request_id = -1;
+static const int read_request_id = num_write_buffers;
+
+static const uint8_t scsi_cmd_synchronize_cache_10 = 0x35;
+static const uint8_t scsi_cmd_synchronize_cache_16 = 0x91;
+
+// vendor specific, returns the ATA_STATS counters (cdb[1] bit 0 resets them after reading)
+// little-endian: "ATAS", version, clk_sys Hz, then per command type (read, write, other):
+// commands, status polls, timeouts, errors, phase cycles (u64 x5), phase max cycles (u32 x5)
+static const uint8_t scsi_cmd_read_ata_stats = 0xC0;
+static const uint32_t ata_stats_version = 1;
+
+static WriteBuffer write_buffers[num_write_buffers];
+static WriteBuffer *filling_write_buffer = nullptr;
+
+static WriteTransfer write_transfer;
+
+static ReadSegment read_segments[num_read_segments];
+
+static bool sync_request_done = false;
+static ata_worker::Response sync_response;
+
+// a READ(10)/WRITE(10) chunk that's waiting for the disk, TinyUSB is told when it's done
+struct PendingIO
+{
+    bool active = false;
+    bool write;
+
+    uint8_t lun;
+    uint32_t lba;
+    void *buffer;
+    uint32_t bufsize;
+};
+
+static PendingIO pending_io;
+
+// the READ(10)/WRITE(10) a chunk is part of
+struct SCSITransfer
+{
+    uint32_t tag;
+    uint32_t lba;
+    uint32_t num_blocks;
+};
+
+// TinyUSB only gives the callbacks the LBA of each chunk (offset is within that block), not the command
+// so the CBW buffer is picked up when it's queued (linked with --wrap=usbd_edpt_xfer), it's valid until the status is sent
+static const msc_cbw_t *last_cbw = nullptr;
+
+extern "C" bool __real_usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes);
+
+extern "C" bool __wrap_usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t *buffer, uint16_t total_bytes)
+{
+    // nothing else receives 31 bytes
+    if(tu_edpt_number(ep_addr) != 0 && tu_edpt_dir(ep_addr) == TUSB_DIR_OUT && total_bytes == sizeof(msc_cbw_t))
+        last_cbw = reinterpret_cast<const msc_cbw_t *>(buffer);
+
+    return __real_usbd_edpt_xfer(rhport, ep_addr, buffer, total_bytes);
+}
+
+static_assert(std::is_same_v<decltype(__wrap_usbd_edpt_xfer), decltype(usbd_edpt_xfer)>, "usbd_edpt_xfer has changed, update the wrapper");
+
+// returns false if the CBW isn't the command the chunk is from
+static bool get_scsi_transfer(uint8_t opcode, uint32_t lba, SCSITransfer &transfer)
+{
+    auto cbw = last_cbw;
+
+    if(!cbw || cbw->signature != MSC_CBW_SIGNATURE || cbw->command[0] != opcode)
+        return false;
+
+    auto cmd = cbw->command;
+
+    transfer.tag = cbw->tag;
+    transfer.lba = uint32_t(cmd[2]) << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5];
+    transfer.num_blocks = cmd[7] << 8 | cmd[8];
+
+    return lba >= transfer.lba && lba - transfer.lba < transfer.num_blocks;
+}
+
+// one for each detected device, in device order
+static LogicalUnit units[2];
+static int num_units = 0;
+
+static void handle_worker_responses()
+{
+    ata_worker::Response response;
+
+    while(ata_worker::get_response(response))
+    {
+        if(response.id == sync_request_id)
+        {
+            sync_response = response;
+            sync_request_done = true;
+        }
+        else if(response.id < read_request_id)
+        {
+            auto &buf = write_buffers[response.id];
+
+            // reported with the last chunk of the transfer
+            if(response.result != buf.num_sectors)
+            {
+                if(write_transfer.active && buf.transfer == write_transfer.id)
+                    write_transfer.failed = true;
+                else
+                    buf.unit->write_failed = true;
+            }
+
+            buf.state = WriteBuffer::State::Free;
+        }
+        else
+        {
+            auto &seg = read_segments[response.id - read_request_id];
+
+            seg.result = response.result;
+            seg.sense_key = response.sense_key;
+            seg.sense_asc = response.sense_asc;
+            seg.sense_ascq = response.sense_ascq;
+            seg.state = seg.stale ? ReadSegment::State::Free : ReadSegment::State::Ready;
+        }
+    }
+}
+
+// the host reset (or TinyUSB started another command after a BOT reset), so the chunk is never completed
+// TinyUSB reuses the buffer, so nothing more can be read from or written to it
+static void drop_pending_io()
+{
+    if(!pending_io.active)
+        return;
+
+    pending_io.active = false;
+
+    // writes that were already submitted can't be stopped, but the rest of the transfer is dropped
+    // and a failure is no longer reported to anything
+    if(pending_io.write && write_transfer.active)
+    {
+        auto buf = filling_write_buffer;
+        if(buf && buf->transfer == write_transfer.id)
+        {
+            buf->state = WriteBuffer::State::Free;
+            filling_write_buffer = nullptr;
+        }
+
+        write_transfer.active = false;
+        write_transfer.last_chunk = false;
+    }
+}
+
+static bool submit_write_buffer(WriteBuffer &buf)
+{
+    ata_worker::Request request{ata_worker::RequestType::Write, int(&buf - write_buffers), buf.unit->device, buf.lba, buf.num_sectors, buf.data};
+
+    if(!ata_worker::submit(request))
+        return false;
+
+    buf.state = WriteBuffer::State::Writing;
+
+    if(filling_write_buffer == &buf)
+        filling_write_buffer = nullptr;
+
+    return true;
+}
+
+// writes the buffer that's being filled if it's old enough, called regularly
+// (the rest of the transfer is usually on the way, this is for a host that stalls or gives up halfway)
+static void update_write_back()
+{
+    handle_worker_responses();
+
+    if(filling_write_buffer && time_reached(filling_write_buffer->write_time))
+        submit_write_buffer(*filling_write_buffer);
+}
+
+// can also take a segment that was never used (a read-ahead that the host didn't want)
+static ReadSegment *find_free_segment(const ReadSegment *in_use)
+{
+    for(auto &seg : read_segments)
+    {
+        if(seg.state == ReadSegment::State::Free)
+            return &seg;
+    }
+
+    for(auto &seg : read_segments)
+    {
+        if(seg.state == ReadSegment::State::Ready && &seg != in_use)
+            return &seg;
+    }
+
+    return nullptr;
+}
+
+// a read in progress or finished containing the sector
+static ReadSegment *find_segment(const LogicalUnit &unit, uint32_t lba)
+{
+    for(auto &seg : read_segments)
+    {
+        if(seg.state == ReadSegment::State::Free || seg.stale || seg.unit != &unit)
+            continue;
+
+        if(lba >= seg.lba && lba < seg.lba + seg.num_sectors)
+            return &seg;
+    }
+
+    return nullptr;
+}
+
+static bool start_read(LogicalUnit &unit, ReadSegment &seg, uint32_t lba, int num_sectors)
+{
+    // don't go past the end of the disk
+    if(lba >= unit.profile.num_sectors)
+        return false;
+
+    num_sectors = std::min(uint64_t(num_sectors), unit.profile.num_sectors - lba);
+
+    // anything written to these sectors needs to be on the disk first
+    // (already submitted writes are fine, ata doesn't reorder a read ahead of an earlier write to the same sectors)
+    auto write_buf = filling_write_buffer;
+    if(write_buf && write_buf->unit == &unit && write_buf->lba < lba + num_sectors && lba < write_buf->lba + write_buf->num_sectors)
+    {
+        if(!submit_write_buffer(*write_buf))
+            return false;
+    }
+
+    auto type = unit.profile.is_atapi ? ata_worker::RequestType::PacketRead : ata_worker::RequestType::Read;
+    ata_worker::Request request{type, read_request_id + int(&seg - read_segments), unit.device, lba, num_sectors, seg.data, unit.profile.sector_size};
+
+    if(!ata_worker::submit(request))
+        return false;
+
+    seg.state = ReadSegment::State::Reading;
+    seg.stale = false;
+    seg.unit = &unit;
+    seg.lba = lba;
+    seg.num_sectors = num_sectors;
+
+    return true;
+}
+
+// the segments are sized for 512 byte sectors
+static int get_max_read_sectors(const LogicalUnit &unit)
+{
+    return READ_AHEAD_MAX_SECTORS * 512 / unit.profile.sector_size;
+}
+
+// double the read-ahead for each new segment of a stream
+static void grow_read_ahead(LogicalUnit &unit, int num_sectors)
+{
+    unit.read_ahead_sectors = std::min(std::max(unit.read_ahead_sectors * 2, num_sectors * 2), get_max_read_sectors(unit));
+}
+
+static void invalidate_read_segments(const LogicalUnit &unit, uint32_t lba, int num_sectors)
+{
+    for(auto &seg : read_segments)
+    {
+        bool overlaps = seg.unit == &unit && seg.lba < lba + num_sectors && lba < seg.lba + seg.num_sectors;
+
+        if(!overlaps)
+            continue;
+
+        if(seg.state == ReadSegment::State::Ready)
+            seg.state = ReadSegment::State::Free;
+        else if(seg.state == ReadSegment::State::Reading)
+            seg.stale = true;
+    }
+}
+
+// everything cached is from the old media
+static void invalidate_all_read_segments(LogicalUnit &unit)
+{
+    for(auto &seg : read_segments)
+    {
+        if(seg.unit != &unit)
+            continue;
+
+        if(seg.state == ReadSegment::State::Ready)
+            seg.state = ReadSegment::State::Free;
+        else if(seg.state == ReadSegment::State::Reading)
+            seg.stale = true;
+    }
+
+    unit.next_read_lba = ~0u;
+    unit.read_ahead_sectors = 0;
+}
+
+// the worker owns the bus, so these wait for it
+// (sync_response has the sense data if an ATAPI request failed)
+static int run_sync_request(ata_worker::RequestType type, int device, uint16_t *data = nullptr)
+{
+    ata_worker::Request request{type, sync_request_id, device, 0, 0, data};
+
+    sync_request_done = false;
+
+    while(!ata_worker::submit(request))
+    {
+        ata_worker::update();
+        handle_worker_responses();
+    }
+
+    while(!sync_request_done)
+    {
+        ata_worker::update();
+        handle_worker_responses();
+    }
+
+    return sync_response.result;
+}
+
+static void set_sense_from_response(uint8_t lun, const ata_worker::Response &response)
+{
+    if(response.sense_key)
+        tud_msc_set_sense(lun, response.sense_key, response.sense_asc, response.sense_ascq);
+    else
+        tud_msc_set_sense(lun, SCSI_SENSE_HARDWARE_ERROR, 0x00, 0x00);
+}
+
+// TEST UNIT READY, then READ CAPACITY if the media is new
+static bool test_packet_unit_ready(uint8_t lun)
+{
+    auto &unit = units[lun];
+
+    if(!run_sync_request(ata_worker::RequestType::TestUnitReady, unit.device))
+    {
+        set_sense_from_response(lun, sync_response);
+        unit.media_loaded = false;
+        return false;
+    }
+
+    if(unit.media_loaded)
+        return true;
+
+    uint16_t data[4];
+    if(!run_sync_request(ata_worker::RequestType::ReadCapacity, unit.device, data))
+    {
+        set_sense_from_response(lun, sync_response);
+        return false;
+    }
+
+    auto capacity = reinterpret_cast<uint8_t *>(data);
+    uint32_t last_lba = capacity[0] << 24 | capacity[1] << 16 | capacity[2] << 8 | capacity[3];
+    uint32_t block_size = capacity[4] << 24 | capacity[5] << 16 | capacity[6] << 8 | capacity[7];
+
+    // has to fit the USB and read-ahead buffers
+    if(!block_size || CFG_TUD_MSC_EP_BUFSIZE % block_size || block_size > READ_AHEAD_MAX_SECTORS * 512)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x30, 0x00); // incompatible medium
+        return false;
+    }
+
+    invalidate_all_read_segments(unit);
+
+    unit.profile.num_sectors = uint64_t(last_lba) + 1;
+    unit.profile.sector_size = block_size;
+    unit.media_loaded = true;
+
+    return true;
+}
+
+static void refresh_device_profile(LogicalUnit &unit)
+{
+    // the IDENTIFY data doesn't change with the media
+    if(unit.profile.is_atapi)
+    {
+        unit.media_loaded = false;
+        return;
+    }
+
+    uint16_t data[256];
+
+    if(run_sync_request(ata_worker::RequestType::Identify, unit.device, data))
+        ata::parse_device_profile(data, unit.profile);
+    else
+        unit.profile.valid = false;
+}
+
+static void put_le32(uint8_t *&ptr, uint32_t val)
+{
+    for(int i = 0; i < 4; i++)
+        *ptr++ = val >> (i * 8);
+}
+
+// returns the length, or -1 if stats are disabled
+static int32_t read_ata_stats(uint8_t const scsi_cmd[16], uint8_t *buffer, uint16_t bufsize)
+{
+    const int num_types = static_cast<int>(ata::StatsCommandType::Count);
+    const int num_phases = static_cast<int>(ata::StatsPhase::Count);
+
+    uint8_t data[12 + num_types * (16 + num_phases * 12)];
+    uint8_t *ptr = data;
+
+    memcpy(ptr, "ATAS", 4);
+    ptr += 4;
+    put_le32(ptr, ata_stats_version);
+    put_le32(ptr, clock_get_hz(clk_sys));
+
+    for(int i = 0; i < num_types; i++)
+    {
+        ata::CommandStats stats;
+        if(!ata::get_stats(static_cast<ata::StatsCommandType>(i), stats))
+            return -1;
+
+        put_le32(ptr, stats.commands);
+        put_le32(ptr, stats.status_polls);
+        put_le32(ptr, stats.timeouts);
+        put_le32(ptr, stats.errors);
+
+        for(auto cycles : stats.phase_cycles)
+        {
+            put_le32(ptr, cycles);
+            put_le32(ptr, cycles >> 32);
+        }
+
+        for(auto cycles : stats.phase_max_cycles)
+            put_le32(ptr, cycles);
+    }
+
+    if(scsi_cmd[1] & 1)
+        ata::reset_stats();
+
+    int alloc_len = scsi_cmd[7] << 8 | scsi_cmd[8];
+    int len = std::min({alloc_len, int(sizeof(data)), int(bufsize)});
+    memcpy(buffer, data, len);
+
+    return len;
+}
+
+// write everything buffered, then flush the device's cache
+// (a WRITE(10) is on the disk before its status is sent, so this is only left over from an aborted one)
+static bool synchronize_cache(LogicalUnit &unit)
+{
+    // read-only
+    if(unit.profile.is_atapi)
+        return true;
+
+    if(filling_write_buffer && filling_write_buffer->unit == &unit)
+    {
+        while(!submit_write_buffer(*filling_write_buffer))
+        {
+            ata_worker::update();
+            handle_worker_responses();
+        }
+    }
+
+    // the flush request waits for the writes, but we want the result of the writes too
+    bool ok = run_sync_request(ata_worker::RequestType::Flush, unit.device);
+
+    ok = ok && !unit.write_failed;
+    unit.write_failed = false;
+
+    return ok;
+}
 
 void set_activity_led(bool on)
 {
@@ -21,27 +572,32 @@ void set_activity_led(bool on)
 
 void tud_mount_cb()
 {
-    storage_ejected = false;
+    for(auto &unit : units)
+        unit.ejected = false;
+}
+
+// also called on a bus reset
+void tud_umount_cb()
+{
+    drop_pending_io();
+}
+
+// with nothing detected there's still one (not ready) LUN
+uint8_t tud_msc_get_maxlun_cb()
+{
+    return std::max(num_units, 1);
 }
 
 void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
 {
-    (void) lun;
+    drop_pending_io();
 
     const char vid[] = USB_VENDOR_STR;
     const char rev[] = "1.0";
 
     // copy some of the model number to the product id
-    if(device_detected)
-    {
-        uint16_t data[256];
-        ata::identify_device(0, data);
-        ata::IdentityParser parser(data);
-
-        char str_buf[41];
-        parser.model_number(str_buf);
-        memcpy(product_id , str_buf, 16);
-    }
+    if(lun < num_units)
+        memcpy(product_id , units[lun].profile.model, 16);
 
     memcpy(vendor_id  , vid, strlen(vid));
     memcpy(product_rev, rev, strlen(rev));
@@ -49,83 +605,356 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
 
 bool tud_msc_test_unit_ready_cb(uint8_t lun)
 {
-    if(storage_ejected || !device_detected)
+    drop_pending_io();
+
+    if(lun >= num_units || units[lun].ejected || !units[lun].profile.valid)
     {
         tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
         return false;
     }
 
+    if(units[lun].profile.is_atapi)
+        return test_packet_unit_ready(lun);
+
     return true;
 }
 
 void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
 {
-    (void) lun;
+    drop_pending_io();
 
-    if(!device_detected)
+    if(lun >= num_units)
     {
         *block_count = 0;
         *block_size = 0;
         return;
     }
 
-    uint16_t data[256];
-    ata::identify_device(0, data);
-    ata::IdentityParser parser(data);
+    auto &unit = units[lun];
 
-    *block_size = 512; // TODO: ATAPI
-    *block_count = parser.total_user_addressable_sectors();
+    // hosts usually check the unit is ready first, but the capacity may not be known yet
+    if(unit.profile.is_atapi && !unit.media_loaded && !test_packet_unit_ready(lun))
+    {
+        *block_count = 0;
+        *block_size = 0;
+        return;
+    }
+
+    // READ(10)/WRITE(10) can't address past 2^32 sectors, so bigger disks are clamped to that
+    // (TinyUSB reports block_count - 1 as the last LBA and rejects 0, so 0xFFFFFFFF can't be returned)
+    *block_size = unit.profile.sector_size;
+    *block_count = std::min(unit.profile.num_sectors, uint64_t(UINT32_MAX));
 }
 
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
 {
-    (void) lun;
+    drop_pending_io();
+
     (void) power_condition;
 
-    if(load_eject)
+    if(load_eject && lun < num_units)
     {
+        auto &unit = units[lun];
+
         if (start)
         {
+            // the media may have changed
+            refresh_device_profile(unit);
+            unit.ejected = false;
         }
         else
-            storage_ejected = true;
+        {
+            synchronize_cache(unit);
+            unit.ejected = true;
+        }
     }
 
     return true;
 }
 
-int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+// these return 0 if the disk is busy, the callbacks then complete the chunk later from update_pending_io
+static int32_t read10(uint8_t lun, uint32_t lba, void *buffer, uint32_t bufsize)
 {
-    (void) lun;
+    handle_worker_responses();
+
+    if(lun >= num_units)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
+        return -1;
+    }
+
+    auto &unit = units[lun];
+
+    int sector_size = unit.profile.sector_size;
+    int num_sectors = bufsize / sector_size;
+    bool sequential = lba == unit.next_read_lba;
+
+    if(unit.profile.is_atapi && !unit.media_loaded)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00); // medium not present
+        return -1;
+    }
+
+    if(lba + num_sectors > unit.profile.num_sectors)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00); // LBA out of range
+        return -1;
+    }
+
+    // the rest of the READ(10), the chunks after this are read with it
+    SCSITransfer scsi;
+    bool known = get_scsi_transfer(SCSI_CMD_READ_10, lba, scsi);
+    uint32_t end_lba = known ? scsi.lba + scsi.num_blocks : lba + num_sectors;
+
+    auto seg = find_segment(unit, lba);
+
+    if(!seg)
+    {
+        // read more than was asked for if this looks like a stream
+        // (without the CBW, a full USB buffer is probably the start of a longer transfer)
+        if(sequential)
+            grow_read_ahead(unit, num_sectors);
+        else if(!known && bufsize == CFG_TUD_MSC_EP_BUFSIZE)
+            unit.read_ahead_sectors = std::min(num_sectors * 2, get_max_read_sectors(unit));
+        else
+            unit.read_ahead_sectors = 0;
 
-    set_activity_led(true);
+        seg = find_free_segment(nullptr);
 
-    // uh, ATA words, not ARM words
-    auto word_buf = reinterpret_cast<uint16_t *>(buffer);
-    auto read = ata::read_sectors(0, lba, bufsize / 512, word_buf);
+        int read_sectors = std::min(std::max(int(end_lba - lba), unit.read_ahead_sectors), get_max_read_sectors(unit));
+
+        if(!seg || !start_read(unit, *seg, lba, std::max(num_sectors, read_sectors)))
+            return 0;
+
+        set_activity_led(true);
+    }
+
+    // start reading the next segment while the host works through this one
+    uint32_t next_lba = seg->lba + seg->num_sectors;
+    if((sequential || end_lba > next_lba) && !find_segment(unit, next_lba))
+    {
+        auto next_seg = find_free_segment(seg);
+
+        if(next_seg)
+        {
+            if(sequential)
+                grow_read_ahead(unit, num_sectors);
+
+            int read_sectors = std::min(std::max(int(end_lba - next_lba), unit.read_ahead_sectors), get_max_read_sectors(unit));
+            start_read(unit, *next_seg, next_lba, read_sectors);
+        }
+    }
+
+    if(seg->state != ReadSegment::State::Ready)
+        return 0;
 
     set_activity_led(false);
 
-    return read * 512;
+    int seg_offset = lba - seg->lba;
+    int available = seg->result - seg_offset;
+
+    if(available <= 0)
+    {
+        seg->state = ReadSegment::State::Free;
+
+        if(seg->sense_key)
+            tud_msc_set_sense(lun, seg->sense_key, seg->sense_asc, seg->sense_ascq);
+        else
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00); // unrecovered read error
+        return -1;
+    }
+
+    // this may be less than requested if it crosses into the next segment, TinyUSB asks again for the rest
+    int count = std::min(num_sectors, available);
+    memcpy(buffer, seg->data + seg_offset * sector_size / 2, count * sector_size);
+
+    unit.next_read_lba = lba + count;
+
+    // finished with the segment once the host has read to the end
+    if(unit.next_read_lba == seg->lba + seg->num_sectors)
+        seg->state = ReadSegment::State::Free;
+
+    return count * sector_size;
 }
 
-int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
+// copies a chunk to the buffer being filled, returns false if there isn't one free yet
+static bool buffer_write(LogicalUnit &unit, uint32_t lba, const uint8_t *data, int num_sectors)
+{
+    // write out what we have if this can't be merged
+    auto buf = filling_write_buffer;
+    if(buf && (buf->unit != &unit || buf->transfer != write_transfer.id || lba != buf->lba + buf->num_sectors || buf->num_sectors + num_sectors > WRITE_BACK_MAX_SECTORS))
+    {
+        if(!submit_write_buffer(*buf))
+            return false;
+    }
+
+    if(!filling_write_buffer)
+    {
+        buf = nullptr;
+        for(auto &write_buf : write_buffers)
+        {
+            if(write_buf.state == WriteBuffer::State::Free)
+            {
+                buf = &write_buf;
+                break;
+            }
+        }
+
+        if(!buf)
+            return false;
+
+        buf->state = WriteBuffer::State::Filling;
+        buf->unit = &unit;
+        buf->lba = lba;
+        buf->num_sectors = 0;
+        buf->transfer = write_transfer.id;
+        buf->write_time = make_timeout_time_ms(WRITE_BACK_MAX_AGE_MS);
+
+        filling_write_buffer = buf;
+    }
+
+    memcpy(buf->data + buf->num_sectors * 256, data, num_sectors * 512);
+    buf->num_sectors += num_sectors;
+
+    // drop any cached data this replaces
+    invalidate_read_segments(unit, lba, num_sectors);
+
+    // write as soon as it's full (or later if the queue is full)
+    if(buf->num_sectors == WRITE_BACK_MAX_SECTORS)
+        submit_write_buffer(*buf);
+
+    return true;
+}
+
+// chunks are merged and acknowledged once they're buffered, the last one of the transfer returns 0 until it's all written
+static int32_t write10(uint8_t lun, uint32_t lba, const uint8_t *buffer, uint32_t bufsize)
 {
-    (void) lun;
+    handle_worker_responses();
+
+    if(lun >= num_units)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);
+        return -1;
+    }
+
+    auto &unit = units[lun];
 
-    set_activity_led(true);
+    if(unit.profile.is_atapi)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00); // write protected
+        return -1;
+    }
 
-    auto word_buf = reinterpret_cast<uint16_t *>(buffer);
-    auto written = ata::write_sectors(0, lba, bufsize / 512, word_buf);
+    auto &xfer = write_transfer;
+    int num_sectors = bufsize / 512;
 
-    set_activity_led(false);
+    if(!xfer.last_chunk)
+    {
+        SCSITransfer scsi;
+        bool known = get_scsi_transfer(SCSI_CMD_WRITE_10, lba, scsi);
+
+        if(!xfer.active || lba != xfer.next_lba || (known && scsi.tag != xfer.tag))
+        {
+            xfer.active = true;
+            xfer.failed = false;
+            xfer.id++;
+            xfer.tag = known ? scsi.tag : 0;
+            xfer.next_lba = lba;
+
+            // without the CBW every chunk has to be written before it's acknowledged
+            xfer.end_lba = known ? scsi.lba + scsi.num_blocks : lba + num_sectors;
+        }
+
+        if(!buffer_write(unit, lba, buffer, num_sectors))
+            return 0;
+
+        xfer.next_lba = lba + num_sectors;
+
+        if(xfer.next_lba < xfer.end_lba)
+            return bufsize;
+
+        xfer.last_chunk = true;
+    }
+
+    // write the rest and wait for all of it
+    if(filling_write_buffer && !submit_write_buffer(*filling_write_buffer))
+        return 0;
+
+    for(auto &buf : write_buffers)
+    {
+        if(buf.state == WriteBuffer::State::Writing)
+            return 0;
+    }
+
+    xfer.active = false;
+    xfer.last_chunk = false;
+
+    if(xfer.failed)
+    {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x03, 0x00); // write fault
+        return -1;
+    }
 
-    return written * 512;
+    return bufsize;
+}
+
+static int32_t start_pending_io(bool write, uint8_t lun, uint32_t lba, void *buffer, uint32_t bufsize)
+{
+    pending_io.active = true;
+    pending_io.write = write;
+    pending_io.lun = lun;
+    pending_io.lba = lba;
+    pending_io.buffer = buffer;
+    pending_io.bufsize = bufsize;
+
+    return TUD_MSC_RET_ASYNC;
+}
+
+// retries the waiting chunk, called regularly
+static void update_pending_io()
+{
+    if(!pending_io.active)
+        return;
+
+    int32_t ret;
+    if(pending_io.write)
+        ret = write10(pending_io.lun, pending_io.lba, static_cast<const uint8_t *>(pending_io.buffer), pending_io.bufsize);
+    else
+        ret = read10(pending_io.lun, pending_io.lba, pending_io.buffer, pending_io.bufsize);
+
+    if(ret == 0)
+        return;
+
+    // the sense data is already set if this failed
+    pending_io.active = false;
+    tud_msc_async_io_done(ret, false);
+}
+
+// return without waiting for the disk, so tud_task keeps handling the control endpoint during seeks and spin-up
+// (offset is within the LBA, it's always 0 as these only ever take whole blocks)
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
+{
+    drop_pending_io();
+
+    int32_t ret = read10(lun, lba, buffer, bufsize);
+
+    return ret == 0 ? start_pending_io(false, lun, lba, buffer, bufsize) : ret;
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
+{
+    drop_pending_io();
+
+    int32_t ret = write10(lun, lba, buffer, bufsize);
+
+    return ret == 0 ? start_pending_io(true, lun, lba, buffer, bufsize) : ret;
 }
 
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize)
 {
-    uint16_t resplen = 0;
+    drop_pending_io();
+
+    int32_t resplen = 0;
 
     switch (scsi_cmd[0])
     {
@@ -134,6 +963,21 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, u
             resplen = 0;
         break;
 
+        case scsi_cmd_synchronize_cache_10:
+        case scsi_cmd_synchronize_cache_16:
+            if(lun < num_units && !synchronize_cache(units[lun]))
+            {
+                tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x03, 0x00); // write fault
+                resplen = -1;
+            }
+        break;
+
+        case scsi_cmd_read_ata_stats:
+            resplen = read_ata_stats(scsi_cmd, (uint8_t *)buffer, bufsize);
+            if(resplen < 0)
+                tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+        break;
+
         default:
             printf("SCSI cmd %02X\n", scsi_cmd[0]);
             // Set Sense = Invalid Command Operation
@@ -149,33 +993,57 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, u
 
 bool tud_msc_is_writable_cb(uint8_t lun)
 {
-    return true;
+    return lun < num_units && !units[lun].profile.is_atapi;
 }
 
-static void setup_pio_timing()
+// identifies the device and sets up its transfer modes, returns false if there isn't one
+static bool detect_device(LogicalUnit &unit, absolute_time_t timeout)
 {
-    // this only covers "advanced" PIO modes (3-4)
-    // modes 0-2 use word 51
+    int device = unit.device;
 
-    // identify
-    uint16_t data[256];
-    ata::identify_device(0, data);
+    // nothing is driving the bus
+    ata::select_device(device);
+    if(ata::read_register(ata::ATAReg::Status) == 0xFF)
+        return false;
+
+    // DEVICE RESET sets the signature on packet devices, ATA devices abort it
+    bool is_atapi = false;
 
-    ata::IdentityParser parser(data);
+    if(ata::device_reset(device))
+    {
+        uint8_t lba_mid = ata::read_register(ata::ATAReg::LBAMid);
+        uint8_t lba_high = ata::read_register(ata::ATAReg::LBAHigh);
+        is_atapi = lba_mid == 0x14 && lba_high == 0xEB;
+    }
 
-    // set "advanced" PIO mode (with flow control)
-    if(parser.timing_params_valid() && parser.advanced_pio_modes_supported())
+    if(is_atapi)
     {
-        int mode = (parser.advanced_pio_modes_supported() & (1 << 1)) ? 4 : 3;
-        ata::set_features(0, ata::ATAFeature::SetTransferMode, 1 << 3/*PIO flow control mode*/ | mode);
+        // packet commands only use PIO
+        if(!ata::read_device_profile(device, unit.profile, ata::ATACommand::IDENTIFY_PACKET_DEVICE))
+            return false;
+
+        if(unit.profile.max_pio_mode >= 3)
+            ata::set_transfer_mode(device, ata::TransferMode::PIO, unit.profile.max_pio_mode);
+
+        ata::adjust_for_min_cycle_time(device, unit.profile.min_pio_cycle_time);
+
+        return true;
     }
 
-    // reconfigure for speed
-    int min_cycle_time = 600;
-    if(parser.timing_params_valid())
-        min_cycle_time = parser.min_pio_cycle_time_iordy();
+    // device 0 answers for a missing device 1 with a zero status
+    if(ata::read_register(ata::ATAReg::Status) == 0)
+        return false;
+
+    // wait for DRDY
+    while(!ata::check_ready() && !time_reached(timeout))
+        tud_task();
 
-    ata::adjust_for_min_cycle_time(min_cycle_time);
+    if(!ata::read_device_profile(device, unit.profile))
+        return false;
+
+    ata::setup_transfer_modes(device, unit.profile);
+
+    return true;
 }
 
 int main()
@@ -194,12 +1062,10 @@ int main()
 
     ata::do_reset();
 
-    // TODO: check if ATAPI
-
-    // make sure we're ready
+    // make sure we're ready (ATAPI devices don't set DRDY until IDENTIFY PACKET DEVICE)
     auto timeout = make_timeout_time_ms(10000);
     bool ready = true;
-    while(!ata::check_ready())
+    while(ata::read_register(ata::ATAReg::Status) & ata::Status_BSY)
     {
         if(time_reached(timeout))
         {
@@ -211,14 +1077,35 @@ int main()
         tud_task();
     }
 
-    device_detected = ready;
+    // reset timings for init
+    ata::adjust_for_min_cycle_time(600);
+
+    for(int device = 0; ready && device < 2; device++)
+    {
+        auto &unit = units[num_units];
+        unit.device = device;
+
+        if(detect_device(unit, timeout))
+            num_units++;
+    }
+
+    // wait for INTRQ instead of polling if it's connected
+    // (the pin is pulled down, so if it isn't every wait would time out)
+    if(num_units && ata::set_interrupts_enabled(true) && !ata::test_interrupt(units[0].device))
+    {
+        printf("INTRQ not connected, polling\n");
+        ata::set_interrupts_enabled(false);
+    }
 
-    if(device_detected)
-        setup_pio_timing();
+    // the bus belongs to the worker from here
+    ata_worker::init(ATA_WORKER_CORE1);
 
     while(true)
     {
         tud_task();
+        ata_worker::update();
+        update_write_back();
+        update_pending_io();
     }
 
     return 0;
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// lock-free single producer, single consumer queue
+// (one core pushes, the other pops)
+template<class T, unsigned size>
+class SPSCQueue final
+{
+public:
+    static_assert((size & (size - 1)) == 0, "size should be a power of two");
+
+    bool push(const T &item)
+    {
+        auto write = write_index.load(std::memory_order_relaxed);
+
+        if(write - read_index.load(std::memory_order_acquire) == size)
+            return false;
+
+        items[write % size] = item;
+        write_index.store(write + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool peek(T &item) const
+    {
+        auto read = read_index.load(std::memory_order_relaxed);
+
+        if(read == write_index.load(std::memory_order_acquire))
+            return false;
+
+        item = items[read % size];
+
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        if(!peek(item))
+            return false;
+
+        read_index.store(read_index.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    bool empty() const
+    {
+        return write_index.load(std::memory_order_acquire) == read_index.load(std::memory_order_acquire);
+    }
+
+    bool full() const
+    {
+        return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_acquire) == size;
+    }
+
+private:
+    T items[size];
+
+    std::atomic<uint32_t> read_index{0}, write_index{0};
+};
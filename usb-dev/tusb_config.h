@@ -94,6 +94,7 @@
 
 #ifndef CFG_TUD_ENDPOINT0_SIZE
 #define CFG_TUD_ENDPOINT0_SIZE    64
+#endif
 
 //------------- CLASS -------------//
 #define CFG_TUD_CDC              1
@@ -110,7 +111,10 @@
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
 // MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE   4096
+// each READ(10)/WRITE(10) callback gets up to this much of the transfer, so larger sizes mean fewer callbacks
+// (a multiple of 512 that divides the read-ahead/write-back buffers, checked in pico-ata-usb.cpp)
+#ifndef CFG_TUD_MSC_EP_BUFSIZE
+#define CFG_TUD_MSC_EP_BUFSIZE   16384
 #endif
 
 #ifdef __cplusplus
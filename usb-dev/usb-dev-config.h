@@ -10,4 +10,24 @@
 
 #ifndef USB_PRODUCT_STR
 #define USB_PRODUCT_STR "Device"
+#endif
+
+// run ATA commands on core1, otherwise they're run from the main loop between USB tasks
+#ifndef ATA_WORKER_CORE1
+#define ATA_WORKER_CORE1 1
+#endif
+
+// max sectors read ahead at once for sequential reads, there are two buffers of this size
+#ifndef READ_AHEAD_MAX_SECTORS
+#define READ_AHEAD_MAX_SECTORS 128
+#endif
+
+// the chunks of a WRITE(10) are merged up to this many sectors, there are two buffers of this size
+#ifndef WRITE_BACK_MAX_SECTORS
+#define WRITE_BACK_MAX_SECTORS 128
+#endif
+
+// merged writes are written after this long even if the rest of the transfer hasn't arrived
+#ifndef WRITE_BACK_MAX_AGE_MS
+#define WRITE_BACK_MAX_AGE_MS 50
 #endif
\ No newline at end of file